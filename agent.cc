@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/progress.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * The agent keeps the evaluated spec and an unlocked package cache in
+ * memory and answers requests on a Unix socket, one line each: "check"
+ * compares the spec with the installed packages, "plan" lists the changes a
+ * run would make and "apply" makes them. The reply is the output followed
+ * by a last line "status N", N being what the command line would exit
+ * with. Changes to the spec files, the dpkg status file or the lists are
+ * picked up through inotify; the spec is then parsed again, where the
+ * tree cache spares every file that did not change, and the package cache
+ * is only reopened when the status file or the lists changed.
+ */
+
+/* the files in one watched directory that belong to the spec */
+struct spec_watch {
+    bool any;                       /* an includedir, where every file does */
+    std::set<std::string> names;
+};
+
+struct inapt_agent {
+    std::vector<const char *> *spec_files, *profile_names;
+    inapt_tree *tree;
+    std::vector<inapt_package *> final_actions;
+    bool spec_failed;               /* the last load failed, so any file may be the fix */
+    pkgCacheFile *cache;
+    int inotify, status_wd, lists_wd;
+    std::map<int, spec_watch> spec_wds;
+    std::string status_name;
+};
+
+static std::string dir_of(const std::string &path) {
+    std::string::size_type slash = path.rfind('/');
+
+    if (slash == std::string::npos)
+        return ".";
+    return slash ? path.substr(0, slash) : "/";
+}
+
+static std::string base_of(const std::string &path) {
+    return path.substr(path.rfind('/') + 1);
+}
+
+/*
+ * Every directory a change to the spec could appear in, with the names
+ * that matter there: the files given, those loaded and those a resolved
+ * include names, and everything in a resolved includedir.
+ */
+static void watch_spec(inapt_agent *agent) {
+    std::map<std::string, spec_watch> dirs;
+    inapt_tree *tree = agent->tree;
+
+    for (std::map<int, spec_watch>::iterator i = agent->spec_wds.begin(); i != agent->spec_wds.end(); i++)
+        if (i->first != agent->status_wd && i->first != agent->lists_wd)    /* a spec in /var/lib/dpkg shares its watch */
+            inotify_rm_watch(agent->inotify, i->first);
+    agent->spec_wds.clear();
+
+    for (std::vector<const char *>::iterator i = agent->spec_files->begin(); i != agent->spec_files->end(); i++)
+        dirs[dir_of(*i)].names.insert(base_of(*i));
+    for (std::unordered_map<std::string, unsigned>::iterator i = tree->loaded.begin(); i != tree->loaded.end(); i++)
+        dirs[dir_of(i->first)].names.insert(base_of(i->first));
+    for (std::vector<inapt_include>::iterator i = tree->includes.begin(); i != tree->includes.end(); i++) {
+        if (!i->resolved)
+            continue;
+
+        std::string path = include_path(tree, &*i);
+        if (i->directory)
+            dirs[path].any = true;
+        else
+            dirs[dir_of(path)].names.insert(base_of(path));
+    }
+
+    for (std::map<std::string, spec_watch>::iterator i = dirs.begin(); i != dirs.end(); i++) {
+        int wd = inotify_add_watch(agent->inotify, i->first.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_MASK_ADD);
+        if (wd < 0) {
+            warnpe("inotify_add_watch: %s", i->first.c_str());
+            continue;
+        }
+
+        /* two paths to one directory share a watch */
+        spec_watch *watch = &agent->spec_wds[wd];
+        watch->any |= i->second.any;
+        watch->names.insert(i->second.names.begin(), i->second.names.end());
+    }
+}
+
+static bool spec_event(inapt_agent *agent, int wd, const char *name) {
+    std::map<int, spec_watch>::iterator watch = agent->spec_wds.find(wd);
+
+    if (watch == agent->spec_wds.end() || name[0] == '.')
+        return false;
+    return agent->spec_failed || watch->second.any || watch->second.names.count(name);
+}
+
+/*
+ * A bad edit must not take the agent down, and the parser and evaluator
+ * give up on errors, so a child parses and evaluates the spec. It hands
+ * the result back as an image in a memory file, so the agent gets exactly
+ * the spec the child checked, however the files change meanwhile.
+ */
+static bool load_spec(inapt_agent *agent) {
+    int fd = memfd_create("inapt-spec", MFD_CLOEXEC);
+    if (fd < 0) {
+        warnpe("memfd_create");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+        fatalpe("fork");
+
+    if (!pid) {
+        inapt_tree tree;
+        std::vector<inapt_package *> final_actions;
+
+        parser(agent->spec_files, &tree);
+        eval_spec(&tree, agent->profile_names, &final_actions);
+        _exit(save_spec_image(fd, &tree, &final_actions) ? 0 : 1);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            fatalpe("waitpid");
+
+    inapt_tree *tree = new inapt_tree;
+    std::vector<inapt_package *> final_actions;
+    bool loaded = WIFEXITED(status) && !WEXITSTATUS(status) && load_spec_image(fd, tree, &final_actions);
+    close(fd);
+
+    if (!loaded) {
+        delete tree;
+        agent->spec_failed = true;
+        warn("keeping the previous spec until the errors above are fixed");
+        return false;
+    }
+
+    delete agent->tree;
+    agent->tree = tree;
+    agent->final_actions.swap(final_actions);
+    agent->spec_failed = false;
+    watch_spec(agent);
+
+    debug("spec loaded, %lu actions", (unsigned long) agent->final_actions.size());
+    return true;
+}
+
+static void open_cache(inapt_agent *agent) {
+    OpProgress prog;
+
+    delete agent->cache;
+    agent->cache = new pkgCacheFile;
+    if (!agent->cache->Open(&prog, false)) {
+        _error->DumpErrors();
+        delete agent->cache;
+        agent->cache = NULL;
+    }
+}
+
+/* reads whatever inotify has, and keeps reading while events arrive, so a burst of writes reloads once */
+static void drain_events(inapt_agent *agent) {
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool spec_changed = false, cache_changed = false;
+    struct pollfd pfd = { agent->inotify, POLLIN, 0 };
+
+    do {
+        ssize_t len = read(agent->inotify, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            fatalpe("read: inotify");
+        }
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + event->len;
+            const char *name = event->len ? event->name : "";
+
+            /* a spec directory may also be the status or lists directory, so the name decides */
+            if (event->mask & IN_Q_OVERFLOW) {
+                spec_changed = cache_changed = true;
+                continue;
+            }
+            if (event->wd == agent->status_wd)
+                cache_changed |= agent->status_name == name;
+            if (event->wd == agent->lists_wd)
+                cache_changed |= strcmp(name, "lock") && strcmp(name, "partial");
+            spec_changed |= spec_event(agent, event->wd, name);
+        }
+    } while (poll(&pfd, 1, 100) > 0);
+
+    if (spec_changed)
+        load_spec(agent);
+    if (cache_changed) {
+        debug("package state changed, reopening the cache");
+        open_cache(agent);
+    }
+}
+
+static void report_errors(FILE *out) {
+    while (!_error->empty()) {
+        std::string message;
+        bool error = _error->PopMessage(message);
+        fprintf(out, "%s: %s\n", error ? "error" : "warning", message.c_str());
+    }
+}
+
+static int plan(inapt_agent *agent, FILE *out) {
+    if (!agent->cache) {
+        open_cache(agent);
+        if (!agent->cache)
+            return 1;
+    }
+
+    pkgCacheFile &cache = *agent->cache;
+    OpProgress prog;
+    cache->Init(&prog);
+
+    if (!plan_actions(agent->tree, &agent->final_actions, cache))
+        return 1;
+
+    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
+        if (cache[i].Install())
+            fprintf(out, "install %s %s\n", i.FullName().c_str(), cache[i].InstVerIter(cache).VerStr());
+        else if (cache[i].Delete())
+            fprintf(out, "%s %s\n", cache[i].Purge() ? "purge" : "remove", i.FullName().c_str());
+    }
+
+    return 0;
+}
+
+/* the run itself takes the locks, so the agent's cache is dropped first and reopened after */
+static int apply(inapt_agent *agent) {
+    delete agent->cache;
+    agent->cache = NULL;
+
+    if (!exec_actions(agent->tree, &agent->final_actions) || _error->PendingError())
+        return 1;
+
+    open_cache(agent);
+    return 0;
+}
+
+static void serve(inapt_agent *agent, int client) {
+    struct timeval timeout = { 2, 0 };
+    char request[64];
+    size_t len = 0;
+
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(request) - 1) {
+        ssize_t n = read(client, request + len, 1);
+        if (n <= 0 || request[len] == '\n')
+            break;
+        len++;
+    }
+    request[len] = '\0';
+
+    FILE *out = fdopen(client, "w");
+    if (!out) {
+        close(client);
+        return;
+    }
+
+    int status;
+    if (!strcmp(request, "check")) {
+        status = check_drift(agent->tree, &agent->final_actions, out);
+    } else if (!strcmp(request, "plan")) {
+        status = plan(agent, out);
+    } else if (!strcmp(request, "apply")) {
+        status = apply(agent);
+    } else {
+        fprintf(out, "error: unknown request '%s'\n", request);
+        status = 2;
+    }
+
+    report_errors(out);
+    fprintf(out, "status %d\n", status);
+    fclose(out);
+}
+
+static int listen_socket() {
+    std::string path = _config->Find("Inapt::Agent::Socket", "/run/inapt.sock");
+    struct sockaddr_un addr;
+
+    if (path.size() >= sizeof(addr.sun_path))
+        fatal("socket path too long: %s", path.c_str());
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        fatalpe("socket");
+    if (unlink(path.c_str()) && errno != ENOENT)
+        fatalpe("unlink: %s", path.c_str());
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)))
+        fatalpe("bind: %s", path.c_str());
+    if (chmod(path.c_str(), 0600))
+        fatalpe("chmod: %s", path.c_str());
+    if (listen(fd, 8))
+        fatalpe("listen: %s", path.c_str());
+
+    return fd;
+}
+
+int run_agent(std::vector<const char *> *spec_files, std::vector<const char *> *profile_names) {
+    inapt_agent agent;
+
+    for (std::vector<const char *>::iterator i = spec_files->begin(); i != spec_files->end(); i++)
+        if (!*i)
+            fatal("the agent needs spec files to watch, not standard input");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    agent.spec_files = spec_files;
+    agent.profile_names = profile_names;
+    agent.tree = NULL;
+    agent.spec_failed = false;
+    agent.cache = NULL;
+
+    agent.inotify = inotify_init1(IN_CLOEXEC);
+    if (agent.inotify < 0)
+        fatalpe("inotify_init1");
+
+    std::string status = _config->FindFile("Dir::State::status");
+    std::string lists = _config->FindDir("Dir::State::lists");
+    agent.status_name = status.substr(status.rfind('/') + 1);
+    agent.status_wd = inotify_add_watch(agent.inotify, dir_of(status).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    agent.lists_wd = inotify_add_watch(agent.inotify, lists.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+    if (agent.status_wd < 0 || agent.lists_wd < 0)
+        fatalpe("inotify_add_watch");
+
+    if (!load_spec(&agent))
+        fatal("unable to load the spec");
+    open_cache(&agent);
+
+    int listener = listen_socket();
+    struct pollfd fds[2] = { { listener, POLLIN, 0 }, { agent.inotify, POLLIN, 0 } };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fatalpe("poll");
+        }
+
+        if (fds[1].revents & POLLIN)
+            drain_events(&agent);
+
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno != EINTR && errno != ECONNABORTED)
+                    warnpe("accept");
+                continue;
+            }
+            serve(&agent, client);
+        }
+    }
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/init.h>
+#include <apt-pkg/pkgsystem.h>
+#include <apt-pkg/progress.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Times the evaluation pipeline on the given specs, best of -r runs each,
+ * and prints the rate in input lines and in the unit each stage works on.
+ * With -f, the directory written by gen -f serves as the root of an APT
+ * configuration for the stages that need a package cache.
+ */
+
+char *prog = NULL;
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double secs, unsigned long long lines, unsigned long long items,
+                   const char *unit) {
+    printf("%-14s %10.3f ms %14.0f lines/s %14.0f %s/s\n", name, secs * 1e3, lines / secs, items / secs, unit);
+}
+
+static unsigned long long count_lines(std::vector<const char *> *files) {
+    unsigned long long lines = 0;
+
+    for (std::vector<const char *>::iterator i = files->begin(); i != files->end(); i++) {
+        FILE *f = fopen(*i, "r");
+        if (!f)
+            fatalpe("open: %s", *i);
+        for (int c; (c = getc(f)) != EOF; )
+            lines += c == '\n';
+        fclose(f);
+    }
+
+    return lines;
+}
+
+static unsigned long long count_directives(inapt_tree *tree) {
+    return tree->actions.size() + tree->profiles.size() + tree->conditionals.size() + tree->includes.size();
+}
+
+static void eval_all(inapt_tree *tree, inapt_profile_set *profiles, std::vector<inapt_package *> *final_actions) {
+    std::vector<bool> seen (tree->blocks.size());
+
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+        seen[*i] = true;
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+        eval_block(tree, *i, profiles, &seen, final_actions);
+}
+
+/* what the marking loops would see: each directive's first alternative, looked up by name; then the marking itself */
+static void bench_sanity(const char *fixture, inapt_tree *tree, std::vector<inapt_package *> *final_actions,
+                         unsigned repeats, unsigned long long lines) {
+    std::string root = fixture;
+
+    pkgInitConfig(*_config);
+    _config->Set("Dir", root);
+    _config->Set("Dir::State::status", root + "/var/lib/dpkg/status");
+    if (!pkgInitSystem(*_config, _system)) {
+        _error->DumpErrors();
+        exit(1);
+    }
+
+    OpProgress prog;
+    pkgCacheFile cache;
+    double start = now();
+    if (!cache.Open(&prog, false)) {
+        _error->DumpErrors();
+        exit(1);
+    }
+    report("cache_open", now() - start, lines, cache.GetPkgCache()->Head().PackageCount, "packages");
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
+        (*i)->pkg = cache->FindPkg(std::string(tree->strings.str(tree->names[(*i)->alternates.begin])));
+
+    double best = 1e30;
+    for (unsigned r = 0; r < repeats; r++) {
+        start = now();
+        sanity_check(tree, final_actions);
+        best = std::min(best, now() - start);
+        _error->Discard();
+    }
+    report("sanity_check", best, lines, final_actions->size(), "packages");
+
+    /* the same marking, directive by directive and then batched */
+    const char *modes[] = { "mark_each", "mark_batch" };
+    for (unsigned m = 0; m < 2; m++) {
+        _config->Set("Inapt::Mark::Batch", m == 1);
+        best = 1e30;
+        for (unsigned r = 0; r < repeats; r++) {
+            int marked = 0;
+            cache->Init(&prog);
+            pkgDepCache::ActionGroup group (cache);
+            start = now();
+            mark_actions(tree, final_actions, cache, &marked);
+            best = std::min(best, now() - start);
+            _error->Discard();
+        }
+        debug("%s: inst %lu del %lu broken %lu", modes[m], cache->InstCount(), cache->DelCount(),
+              cache->BrokenCount());
+        report(modes[m], best, lines, final_actions->size(), "directives");
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: %s [-r repeats] [-p profile]... [-f fixture_dir] filename...\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<const char *> profile_names;
+    const char *fixture = NULL;
+    unsigned repeats = 5;
+    double start, best;
+    int opt;
+
+    prog = xstrdup(argv[0]);
+    while ((opt = getopt(argc, argv, "r:p:f:h")) != -1) {
+        switch (opt) {
+            case 'r': repeats = atoi(optarg); break;
+            case 'p': profile_names.push_back(optarg); break;
+            case 'f': fixture = optarg; break;
+            default: usage();
+        }
+    }
+
+    std::vector<const char *> files (argv + optind, argv + argc);
+    if (files.empty() || !repeats)
+        usage();
+
+    /* measure the parser, not the tree cache */
+    _config->Set("Inapt::Cache", false);
+
+    unsigned long long lines = count_lines(&files);
+    inapt_tree *tree = NULL;
+
+    best = 1e30;
+    for (unsigned r = 0; r < repeats; r++) {
+        delete tree;
+        tree = new inapt_tree;
+        start = now();
+        parser(&files, tree);
+        load_all_includes(tree);
+        best = std::min(best, now() - start);
+    }
+    unsigned long long directives = count_directives(tree);
+    report("parser", best, lines, directives, "directives");
+
+    inapt_profile_set initial, profiles;
+    for (std::vector<const char *>::iterator i = profile_names.begin(); i != profile_names.end(); i++)
+        initial.set(tree->strings.profile(*i));
+
+    best = 1e30;
+    for (unsigned r = 0; r < repeats; r++) {
+        inapt_profile_graph graph;
+        profiles = initial;
+        start = now();
+        build_profile_graph(tree, &graph);
+        eval_profiles(tree, &graph, &profiles);
+        best = std::min(best, now() - start);
+    }
+    report("eval_profiles", best, lines, directives, "directives");
+
+    std::vector<inapt_package *> final_actions;
+    best = 1e30;
+    for (unsigned r = 0; r < repeats; r++) {
+        final_actions.clear();
+        start = now();
+        eval_all(tree, &profiles, &final_actions);
+        best = std::min(best, now() - start);
+    }
+    report("eval_block", best, lines, directives, "directives");
+
+    /* every clause in the tree, whether or not evaluation reaches it */
+    unsigned long long hits = 0;
+    best = 1e30;
+    for (unsigned r = 0; r < repeats; r++) {
+        hits = 0;
+        start = now();
+        for (std::vector<inapt_range>::iterator i = tree->clauses.begin(); i != tree->clauses.end(); i++)
+            hits += test_anyprofile(tree->terms.data() + i->begin, tree->terms.data() + i->end, &profiles);
+        best = std::min(best, now() - start);
+    }
+    debug("%llu of %lu clauses true", hits, (unsigned long) tree->clauses.size());
+    report("test_anyprofile", best, lines, tree->clauses.size(), "clauses");
+
+    if (fixture)
+        bench_sanity(fixture, tree, &final_actions, repeats, lines);
+
+    delete tree;
+    return 0;
+}
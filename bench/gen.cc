@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+/*
+ * Writes a synthetic spec to standard output, and optionally a dpkg status
+ * file naming every package in its pool, so that the cache-dependent
+ * benchmarks can open a real APT cache without any lists or network.
+ */
+
+char *prog = NULL;
+
+static unsigned directives = 10000, max_depth = 4, clauses = 1, width = 2, alternates = 1;
+static unsigned num_profiles = 64, per_directive = 4, pool = 5000;
+
+static unsigned pick(unsigned n) {
+    return random() % n;
+}
+
+/* returns the highest profile tested, or -1 for none */
+static int predicate(FILE *f) {
+    int highest = -1;
+
+    for (unsigned i = 0; i < clauses; i++) {
+        fputc('@', f);
+        for (unsigned j = 0; j < width; j++) {
+            int profile = pick(num_profiles);
+            fprintf(f, "%s%sp%d", j ? "/" : "", pick(4) ? "" : "!", profile);
+            highest = std::max(highest, profile);
+        }
+        fputc(' ', f);
+    }
+
+    return highest;
+}
+
+static void package(FILE *f) {
+    for (unsigned i = 0; i < alternates; i++)
+        fprintf(f, "%spkg%u", i ? "/" : "", pick(pool));
+}
+
+/*
+ * A profiles directive only selects profiles numbered above every one its
+ * conditions test, so no profile can depend on its own absence and every
+ * spec generated is valid.
+ */
+static void directive(FILE *f, unsigned indent, int guarded) {
+    fprintf(f, "%*s", indent * 4, "");
+    if (!pick(4))
+        guarded = std::max(guarded, predicate(f));
+
+    unsigned kind = pick(10);
+    if (kind == 0 && guarded + 1 < (int) num_profiles) {
+        fprintf(f, "profiles");
+        for (unsigned i = 0; i < 2; i++)
+            fprintf(f, " p%u", guarded + 1 + pick(num_profiles - guarded - 1));
+    } else {
+        fprintf(f, kind < 8 ? "install" : "remove");
+        for (unsigned i = 0; i < per_directive; i++) {
+            fputc(' ', f);
+            if (!pick(8))
+                predicate(f);
+            package(f);
+        }
+    }
+    fprintf(f, ";\n");
+}
+
+struct gen_block {
+    int guarded;
+    bool in_else;
+};
+
+static void spec(FILE *f) {
+    std::vector<gen_block> open;
+    int guarded = -1;
+
+    for (unsigned i = 0; i < directives; i++) {
+        if (open.size() < max_depth && !pick(8)) {
+            fprintf(f, "%*sif ", (int) open.size() * 4, "");
+            gen_block block = { guarded, false };
+            open.push_back(block);
+            guarded = std::max(guarded, predicate(f));
+            fprintf(f, "{\n");
+        } else if (!open.empty() && !pick(8)) {
+            if (!open.back().in_else && pick(2)) {
+                fprintf(f, "%*s} else {\n", (int) (open.size() - 1) * 4, "");
+                open.back().in_else = true;
+            } else {
+                fprintf(f, "%*s};\n", (int) (open.size() - 1) * 4, "");
+                guarded = open.back().guarded;
+                open.pop_back();
+            }
+        }
+        directive(f, open.size(), guarded);
+    }
+
+    while (!open.empty()) {
+        fprintf(f, "%*s};\n", (int) (open.size() - 1) * 4, "");
+        open.pop_back();
+    }
+}
+
+static void fixture(const char *dir) {
+    std::string base = dir;
+    const char *subdirs[] = {
+        "", "/etc", "/etc/apt", "/var", "/var/lib", "/var/lib/dpkg", "/var/lib/apt", "/var/lib/apt/lists",
+        "/var/lib/apt/lists/partial", "/var/cache", "/var/cache/apt", "/var/cache/apt/archives",
+        "/var/cache/apt/archives/partial",
+    };
+
+    for (unsigned i = 0; i < sizeof(subdirs) / sizeof(*subdirs); i++)
+        if (mkdir((base + subdirs[i]).c_str(), 0755) && errno != EEXIST)
+            fatalpe("mkdir: %s%s", dir, subdirs[i]);
+
+    std::string path = base + "/etc/apt/sources.list";
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f || fclose(f))
+        fatalpe("write: %s", path.c_str());
+
+    /*
+     * Every other package installed, so both directives have work to check,
+     * and each depending on one of half its number, so installs pull in
+     * chains of dependencies. Installed packages only depend on installed
+     * ones, leaving nothing broken to begin with.
+     */
+    path = base + "/var/lib/dpkg/status";
+    f = fopen(path.c_str(), "w");
+    if (!f)
+        fatalpe("open: %s", path.c_str());
+    for (unsigned i = 0; i < pool; i++) {
+        unsigned dep = i % 2 ? (i / 2) | 1 : i / 2;
+        fprintf(f, "Package: pkg%u\nStatus: install ok %s\nPriority: optional\nSection: misc\n"
+                   "Maintainer: Bench <bench@example.org>\nArchitecture: all\nVersion: 1.0\n",
+                i, i % 2 ? "installed" : "not-installed");
+        if (dep != i)
+            fprintf(f, "Depends: pkg%u\n", dep);
+        fprintf(f, "Description: benchmark package %u\n\n", i);
+    }
+    if (fclose(f))
+        fatalpe("write: %s", path.c_str());
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: %s [-n directives] [-d depth] [-c clauses] [-w width] [-a alternates]\n"
+                    "       [-p profiles] [-k packages] [-m pool] [-s seed] [-f fixture_dir]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    const char *fixture_dir = NULL;
+    unsigned seed = 1;
+    int opt;
+
+    prog = xstrdup(argv[0]);
+    while ((opt = getopt(argc, argv, "n:d:c:w:a:p:k:m:s:f:h")) != -1) {
+        switch (opt) {
+            case 'n': directives = atoi(optarg); break;
+            case 'd': max_depth = atoi(optarg); break;
+            case 'c': clauses = atoi(optarg); break;
+            case 'w': width = atoi(optarg); break;
+            case 'a': alternates = atoi(optarg); break;
+            case 'p': num_profiles = atoi(optarg); break;
+            case 'k': per_directive = atoi(optarg); break;
+            case 'm': pool = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            case 'f': fixture_dir = optarg; break;
+            default: usage();
+        }
+    }
+
+    /* MAXDEPTH in parser.rl */
+    if (max_depth > 100)
+        fatal("depth may be at most 100");
+    if (!clauses || !width || !alternates || !num_profiles || !per_directive || !pool)
+        fatal("counts must be positive");
+
+    srandom(seed);
+    spec(stdout);
+    if (fixture_dir)
+        fixture(fixture_dir);
+
+    return 0;
+}
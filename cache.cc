@@ -0,0 +1,565 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include <apt-pkg/configuration.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Parsed specs are cached per file as a flat image of the file's tree.
+ * The image is only trusted if the file's identity and timestamps still
+ * match the ones it was made from; anything else means a fresh parse.
+ * The same layout carries a whole evaluated spec, with its includes and
+ * final actions, from the agent's parsing child back to the agent.
+ * Bump CACHE_VERSION whenever the layout of the tree changes.
+ */
+
+#define CACHE_MAGIC "inaptree"
+#define CACHE_VERSION 3
+
+enum cache_section {
+    SECT_STRINGS,       /* offsets into the string data */
+    SECT_COPIED,
+    SECT_STRING_DATA,
+    SECT_PROFILES,      /* string id of each profile */
+    SECT_TERMS,
+    SECT_CLAUSES,
+    SECT_NAMES,
+    SECT_ENABLES,
+    SECT_PACKAGES,
+    SECT_ACTIONS,
+    SECT_PROFILE_DIRECTIVES,
+    SECT_CONDITIONALS,
+    SECT_INCLUDES,
+    SECT_BLOCKS,
+    SECT_ROOTS,
+    SECT_INCLUDED,      /* the rest are only in images of a whole spec */
+    SECT_LOADED,        /* root block of each loaded file */
+    SECT_LOADED_PATHS,  /* their real paths, NUL-terminated in order */
+    SECT_FINAL_ACTIONS, /* package indices */
+    NUM_SECTIONS
+};
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t path_len;
+    uint64_t size, ino, dev;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t counts[NUM_SECTIONS];
+};
+
+/* inapt_package without the package it resolves to */
+struct cache_package {
+    uint32_t action;
+    inapt_range alternates;
+    inapt_predicate predicates;
+    uint32_t filename;
+    int32_t linenum;
+};
+
+static_assert(std::is_trivially_copyable<inapt_action>::value, "inapt_action is copied raw");
+static_assert(std::is_trivially_copyable<inapt_profiles>::value, "inapt_profiles is copied raw");
+static_assert(std::is_trivially_copyable<inapt_conditional>::value, "inapt_conditional is copied raw");
+static_assert(std::is_trivially_copyable<inapt_include>::value, "inapt_include is copied raw");
+static_assert(std::is_trivially_copyable<inapt_block>::value, "inapt_block is copied raw");
+
+static void fill_key(cache_header *header, const char *filename, struct stat *st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->version = CACHE_VERSION;
+    header->path_len = strlen(filename);
+    header->size = st->st_size;
+    header->ino = st->st_ino;
+    header->dev = st->st_dev;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+    header->ctime_sec = st->st_ctim.tv_sec;
+    header->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/* named for a hash of the name the file was given by */
+static std::string cache_path(const char *filename) {
+    uint64_t hash = fnv1a(FNV_OFFSET, filename, strlen(filename));
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%016llx.tree", (unsigned long long) hash);
+    return _config->FindDir("Inapt::Cache::Directory", "/var/cache/inapt/") + buf;
+}
+
+bool cache_enabled() {
+    return _config->FindB("Inapt::Cache", true);
+}
+
+template <class T> static void put(std::string *out, const T *data, size_t count) {
+    out->append((const char *) data, count * sizeof(T));
+    out->resize((out->size() + 7) & ~7UL);
+}
+
+/* once a section overruns the file, every later one fails too */
+struct cache_reader {
+    const char *p, *end;
+    bool truncated;
+
+    template <class T> const T *get(size_t count) {
+        const T *data = (const T *) p;
+        size_t len = (count * sizeof(T) + 7) & ~7UL;
+
+        if (truncated || (size_t) (end - p) < len) {
+            truncated = true;
+            return NULL;
+        }
+        p += len;
+        return data;
+    }
+};
+
+/* the sections of one image, as mapped */
+struct cache_image {
+    const uint32_t *counts;
+    const uint32_t *offsets;
+    const uint8_t *copied;
+    const char *data;
+    const uint32_t *profiles;
+    const unsigned *terms;
+    const inapt_range *clauses;
+    const unsigned *names;
+    const unsigned *enables;
+    const cache_package *packages;
+    const inapt_action *actions;
+    const inapt_profiles *directives;
+    const inapt_conditional *conditionals;
+    const inapt_include *includes;
+    const inapt_block *blocks;
+    const unsigned *roots;
+    const unsigned *included;
+    const unsigned *loaded;
+    const char *loaded_paths;
+    const uint32_t *final_actions;
+};
+
+static inline bool valid_range(inapt_range range, uint32_t count) {
+    return range.begin <= range.end && range.end <= count;
+}
+
+/* bools are copied raw, so any byte other than 0 or 1 in one is a corrupt image */
+static inline bool valid_bool(const void *node, size_t offset) {
+    return ((const uint8_t *) node)[offset] <= 1;
+}
+
+/*
+ * Checks every count, offset, id and range in an image against the others,
+ * so that a damaged or foreign file can at worst cost a parse. Blocks must
+ * nest the way the parser closes them, every branch of a conditional
+ * before the block holding it. The image of one file has a single root,
+ * last of all, and nothing resolved; a whole spec may have any roots.
+ */
+static bool valid_image(const cache_image *image, bool whole) {
+    const uint32_t *counts = image->counts;
+    uint32_t num_strings = counts[SECT_STRINGS], num_blocks = counts[SECT_BLOCKS];
+
+    if (counts[SECT_COPIED] != num_strings || image->offsets[0] != 0
+            || image->offsets[num_strings] != counts[SECT_STRING_DATA])
+        return false;
+    for (uint32_t i = 0; i < num_strings; i++)
+        if (image->offsets[i] >= image->offsets[i + 1] || image->offsets[i + 1] > counts[SECT_STRING_DATA]
+                || image->data[image->offsets[i + 1] - 1] != '\0' || image->copied[i] > 1)
+            return false;
+
+    for (uint32_t i = 0; i < counts[SECT_PROFILES]; i++)
+        if (image->profiles[i] >= num_strings)
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_TERMS]; i++)
+        if ((image->terms[i] >> 1) >= counts[SECT_PROFILES])
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_CLAUSES]; i++)
+        if (!valid_range(image->clauses[i], counts[SECT_TERMS]))
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_NAMES]; i++)
+        if (image->names[i] >= num_strings)
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_ENABLES]; i++)
+        if (image->enables[i] >= counts[SECT_PROFILES])
+            return false;
+
+    for (uint32_t i = 0; i < counts[SECT_PACKAGES]; i++) {
+        const cache_package *package = &image->packages[i];
+        if (package->action > inapt_action::REMOVE || !valid_range(package->alternates, counts[SECT_NAMES])
+                || !valid_range(package->predicates.clauses, counts[SECT_CLAUSES]) || package->filename >= num_strings)
+            return false;
+    }
+    for (uint32_t i = 0; i < counts[SECT_ACTIONS]; i++) {
+        const inapt_action *action = &image->actions[i];
+        uint32_t kind;
+        memcpy(&kind, (const char *) action + offsetof(inapt_action, action), sizeof(kind));
+        if (kind > inapt_action::REMOVE || !valid_range(action->predicates.clauses, counts[SECT_CLAUSES])
+                || !valid_range(action->packages, counts[SECT_PACKAGES]))
+            return false;
+    }
+    for (uint32_t i = 0; i < counts[SECT_PROFILE_DIRECTIVES]; i++) {
+        const inapt_profiles *directive = &image->directives[i];
+        if (!valid_range(directive->predicates.clauses, counts[SECT_CLAUSES])
+                || !valid_range(directive->profiles, counts[SECT_ENABLES]) || directive->filename >= num_strings)
+            return false;
+    }
+    for (uint32_t i = 0; i < counts[SECT_CONDITIONALS]; i++) {
+        const inapt_conditional *cond = &image->conditionals[i];
+        if (!valid_range(cond->predicates.clauses, counts[SECT_CLAUSES]) || cond->then_block >= num_blocks
+                || (cond->else_block != NO_BLOCK && cond->else_block >= num_blocks))
+            return false;
+    }
+    /* a cached tree is saved straight after parsing, before any include is resolved */
+    for (uint32_t i = 0; i < counts[SECT_INCLUDES]; i++) {
+        const inapt_include *include = &image->includes[i];
+        if (!valid_bool(include, offsetof(inapt_include, directory))
+                || !valid_bool(include, offsetof(inapt_include, resolved)) || (include->resolved && !whole)
+                || (include->resolved && !valid_range(include->files, counts[SECT_INCLUDED]))
+                || !valid_range(include->predicates.clauses, counts[SECT_CLAUSES])
+                || include->path >= num_strings || include->filename >= num_strings)
+            return false;
+    }
+    for (uint32_t i = 0; i < counts[SECT_INCLUDED]; i++)
+        if (image->included[i] >= num_blocks)
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_LOADED]; i++)
+        if (image->loaded[i] >= num_blocks)
+            return false;
+    for (uint32_t i = 0; i < counts[SECT_FINAL_ACTIONS]; i++)
+        if (image->final_actions[i] >= counts[SECT_PACKAGES])
+            return false;
+
+    const char *path = image->loaded_paths, *paths_end = path + counts[SECT_LOADED_PATHS];
+    for (uint32_t i = 0; i < counts[SECT_LOADED]; i++) {
+        const char *nul = (const char *) memchr(path, '\0', paths_end - path);
+        if (!nul)
+            return false;
+        path = nul + 1;
+    }
+    if (path != paths_end)
+        return false;
+
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        const inapt_block *block = &image->blocks[i];
+        if (!valid_range(block->actions, counts[SECT_ACTIONS]) || !valid_range(block->children, counts[SECT_CONDITIONALS])
+                || !valid_range(block->profiles, counts[SECT_PROFILE_DIRECTIVES])
+                || !valid_range(block->includes, counts[SECT_INCLUDES]))
+            return false;
+        for (unsigned c = block->children.begin; c < block->children.end; c++) {
+            const inapt_conditional *cond = &image->conditionals[c];
+            if (cond->then_block >= i || (cond->else_block != NO_BLOCK && cond->else_block >= i))
+                return false;
+        }
+    }
+
+    if (whole) {
+        for (uint32_t i = 0; i < counts[SECT_ROOTS]; i++)
+            if (image->roots[i] >= num_blocks)
+                return false;
+        return true;
+    }
+
+    if (counts[SECT_INCLUDED] || counts[SECT_LOADED] || counts[SECT_FINAL_ACTIONS])
+        return false;
+    if (!num_blocks || counts[SECT_ROOTS] != 1 || image->roots[0] != num_blocks - 1)
+        return false;
+    const inapt_block *root = &image->blocks[image->roots[0]];
+    return root->actions.end == counts[SECT_ACTIONS] && root->children.end == counts[SECT_CONDITIONALS]
+        && root->profiles.end == counts[SECT_PROFILE_DIRECTIVES] && root->includes.end == counts[SECT_INCLUDES];
+}
+
+/*
+ * Fills tree from a mapped image made with the given key, if the image
+ * holds together. The tree's strings point into the image, so the tree
+ * keeps it mapped until the last tree merged from it is gone.
+ */
+static bool read_image(std::shared_ptr<inapt_mapping> mapping, const cache_header *key, const char *filename,
+                       bool whole, inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    const cache_header *header = (const cache_header *) mapping->data;
+    cache_reader in = { (const char *) mapping->data, (const char *) mapping->data + mapping->size, false };
+    cache_image image;
+
+    in.get<cache_header>(1);
+    const char *cached_name = in.get<char>(key->path_len + 1);
+    if (in.truncated || memcmp(header, key, offsetof(cache_header, counts))
+            || memcmp(cached_name, filename, key->path_len + 1))
+        return false;
+
+    const uint32_t *counts = image.counts = header->counts;
+    image.offsets = in.get<uint32_t>((size_t) counts[SECT_STRINGS] + 1);
+    image.copied = in.get<uint8_t>(counts[SECT_COPIED]);
+    image.data = in.get<char>(counts[SECT_STRING_DATA]);
+    image.profiles = in.get<uint32_t>(counts[SECT_PROFILES]);
+    image.terms = in.get<unsigned>(counts[SECT_TERMS]);
+    image.clauses = in.get<inapt_range>(counts[SECT_CLAUSES]);
+    image.names = in.get<unsigned>(counts[SECT_NAMES]);
+    image.enables = in.get<unsigned>(counts[SECT_ENABLES]);
+    image.packages = in.get<cache_package>(counts[SECT_PACKAGES]);
+    image.actions = in.get<inapt_action>(counts[SECT_ACTIONS]);
+    image.directives = in.get<inapt_profiles>(counts[SECT_PROFILE_DIRECTIVES]);
+    image.conditionals = in.get<inapt_conditional>(counts[SECT_CONDITIONALS]);
+    image.includes = in.get<inapt_include>(counts[SECT_INCLUDES]);
+    image.blocks = in.get<inapt_block>(counts[SECT_BLOCKS]);
+    image.roots = in.get<unsigned>(counts[SECT_ROOTS]);
+    image.included = in.get<unsigned>(counts[SECT_INCLUDED]);
+    image.loaded = in.get<unsigned>(counts[SECT_LOADED]);
+    image.loaded_paths = in.get<char>(counts[SECT_LOADED_PATHS]);
+    image.final_actions = in.get<uint32_t>(counts[SECT_FINAL_ACTIONS]);
+
+    if (in.truncated || !valid_image(&image, whole))
+        return false;
+
+    /* the strings are NUL-terminated in the mapping, so they count as copies */
+    bool unique = true;
+    for (unsigned i = 0; i < counts[SECT_STRINGS] && unique; i++) {
+        const uint32_t *offsets = image.offsets;
+        unique = tree->strings.intern(std::string_view(image.data + offsets[i], offsets[i + 1] - offsets[i] - 1)) == i;
+        if (unique)
+            tree->strings.copied[i] = image.copied[i];
+    }
+    for (unsigned i = 0; i < counts[SECT_PROFILES] && unique; i++)
+        unique = tree->strings.profile(tree->strings.str(image.profiles[i])) == i;
+
+    /* ids are positions, so a string or profile listed twice would shift every later one */
+    if (!unique) {
+        tree->strings = inapt_strings();
+        return false;
+    }
+
+    tree->terms.assign(image.terms, image.terms + counts[SECT_TERMS]);
+    tree->clauses.assign(image.clauses, image.clauses + counts[SECT_CLAUSES]);
+    tree->names.assign(image.names, image.names + counts[SECT_NAMES]);
+    tree->enables.assign(image.enables, image.enables + counts[SECT_ENABLES]);
+    tree->actions.assign(image.actions, image.actions + counts[SECT_ACTIONS]);
+    tree->profiles.assign(image.directives, image.directives + counts[SECT_PROFILE_DIRECTIVES]);
+    tree->conditionals.assign(image.conditionals, image.conditionals + counts[SECT_CONDITIONALS]);
+    tree->includes.assign(image.includes, image.includes + counts[SECT_INCLUDES]);
+    tree->blocks.assign(image.blocks, image.blocks + counts[SECT_BLOCKS]);
+    tree->roots.assign(image.roots, image.roots + counts[SECT_ROOTS]);
+    tree->included.assign(image.included, image.included + counts[SECT_INCLUDED]);
+
+    tree->packages.resize(counts[SECT_PACKAGES]);
+    for (unsigned i = 0; i < counts[SECT_PACKAGES]; i++) {
+        inapt_package *package = &tree->packages[i];
+        package->action = (inapt_action::action_t) image.packages[i].action;
+        package->alternates = image.packages[i].alternates;
+        package->predicates = image.packages[i].predicates;
+        package->filename = image.packages[i].filename;
+        package->linenum = image.packages[i].linenum;
+    }
+
+    const char *path = image.loaded_paths;
+    for (unsigned i = 0; i < counts[SECT_LOADED]; i++) {
+        tree->loaded[path] = image.loaded[i];
+        path += strlen(path) + 1;
+    }
+
+    for (unsigned i = 0; i < counts[SECT_FINAL_ACTIONS]; i++)
+        final_actions->push_back(&tree->packages[image.final_actions[i]]);
+
+    tree->mappings.push_back(mapping);
+    return true;
+}
+
+static std::shared_ptr<inapt_mapping> map_image(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(cache_header))
+        return NULL;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    return std::make_shared<inapt_mapping>(map, st.st_size);
+}
+
+/* loads the cached tree for filename if it was made from the file as it is now */
+bool load_cached_tree(const char *filename, struct stat *st, inapt_tree *tree) {
+    std::string path = cache_path(filename);
+    cache_header key;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    std::shared_ptr<inapt_mapping> mapping = map_image(fd);
+    close(fd);
+    if (!mapping)
+        return false;
+
+    fill_key(&key, filename, st);
+    if (!read_image(mapping, &key, filename, false, tree, NULL)) {
+        if (!memcmp(mapping->data, &key, offsetof(cache_header, counts)))
+            debug("%s: corrupt cache %s", filename, path.c_str());
+        return false;
+    }
+
+    debug("%s: loaded from cache %s", filename, path.c_str());
+    return true;
+}
+
+/* a whole spec is keyed by no file at all */
+static void fill_spec_key(cache_header *header) {
+    struct stat none;
+
+    memset(&none, 0, sizeof(none));
+    fill_key(header, "", &none);
+}
+
+/* loads a whole evaluated spec written by save_spec_image(), with its final actions */
+bool load_spec_image(int fd, inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    cache_header key;
+
+    std::shared_ptr<inapt_mapping> mapping = map_image(fd);
+    if (!mapping)
+        return false;
+
+    fill_spec_key(&key);
+    return read_image(mapping, &key, "", true, tree, final_actions);
+}
+
+/* header must hold the key already; final_actions may be NULL */
+static void write_image(std::string *out, cache_header *header, const char *filename, inapt_tree *tree,
+                        std::vector<inapt_package *> *final_actions) {
+    std::string data, loaded_paths;
+    std::vector<uint32_t> offsets, profiles, actions;
+    std::vector<uint8_t> copied;
+    std::vector<unsigned> loaded;
+    std::vector<cache_package> packages;
+
+    for (unsigned i = 0; i < tree->strings.strings.size(); i++) {
+        offsets.push_back(data.size());
+        data.append(tree->strings.str(i));
+        data.push_back('\0');
+        copied.push_back(tree->strings.copied[i]);
+    }
+    offsets.push_back(data.size());
+
+    for (unsigned i = 0; i < tree->strings.profile_count(); i++)
+        profiles.push_back(tree->strings.profile_names[i]);
+
+    for (std::vector<inapt_package>::iterator i = tree->packages.begin(); i != tree->packages.end(); i++) {
+        cache_package package;
+        memset(&package, 0, sizeof(package));
+        package.action = i->action;
+        package.alternates = i->alternates;
+        package.predicates = i->predicates;
+        package.filename = i->filename;
+        package.linenum = i->linenum;
+        packages.push_back(package);
+    }
+
+    for (std::unordered_map<std::string, unsigned>::iterator i = tree->loaded.begin(); i != tree->loaded.end(); i++) {
+        loaded_paths.append(i->first);
+        loaded_paths.push_back('\0');
+        loaded.push_back(i->second);
+    }
+
+    if (final_actions)
+        for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
+            actions.push_back(*i - tree->packages.data());
+
+    header->counts[SECT_STRINGS] = tree->strings.strings.size();
+    header->counts[SECT_COPIED] = copied.size();
+    header->counts[SECT_STRING_DATA] = data.size();
+    header->counts[SECT_PROFILES] = profiles.size();
+    header->counts[SECT_TERMS] = tree->terms.size();
+    header->counts[SECT_CLAUSES] = tree->clauses.size();
+    header->counts[SECT_NAMES] = tree->names.size();
+    header->counts[SECT_ENABLES] = tree->enables.size();
+    header->counts[SECT_PACKAGES] = packages.size();
+    header->counts[SECT_ACTIONS] = tree->actions.size();
+    header->counts[SECT_PROFILE_DIRECTIVES] = tree->profiles.size();
+    header->counts[SECT_CONDITIONALS] = tree->conditionals.size();
+    header->counts[SECT_INCLUDES] = tree->includes.size();
+    header->counts[SECT_BLOCKS] = tree->blocks.size();
+    header->counts[SECT_ROOTS] = tree->roots.size();
+    header->counts[SECT_INCLUDED] = tree->included.size();
+    header->counts[SECT_LOADED] = loaded.size();
+    header->counts[SECT_LOADED_PATHS] = loaded_paths.size();
+    header->counts[SECT_FINAL_ACTIONS] = actions.size();
+
+    put(out, header, 1);
+    put(out, filename, header->path_len + 1);
+    put(out, offsets.data(), offsets.size());
+    put(out, copied.data(), copied.size());
+    put(out, data.data(), data.size());
+    put(out, profiles.data(), profiles.size());
+    put(out, tree->terms.data(), tree->terms.size());
+    put(out, tree->clauses.data(), tree->clauses.size());
+    put(out, tree->names.data(), tree->names.size());
+    put(out, tree->enables.data(), tree->enables.size());
+    put(out, packages.data(), packages.size());
+    put(out, tree->actions.data(), tree->actions.size());
+    put(out, tree->profiles.data(), tree->profiles.size());
+    put(out, tree->conditionals.data(), tree->conditionals.size());
+    put(out, tree->includes.data(), tree->includes.size());
+    put(out, tree->blocks.data(), tree->blocks.size());
+    put(out, tree->roots.data(), tree->roots.size());
+    put(out, tree->included.data(), tree->included.size());
+    put(out, loaded.data(), loaded.size());
+    put(out, loaded_paths.data(), loaded_paths.size());
+    put(out, actions.data(), actions.size());
+}
+
+/* written to a temporary file and renamed into place, so readers never see half of it */
+void save_cached_tree(const char *filename, struct stat *st, inapt_tree *tree) {
+    std::string path = cache_path(filename);
+    std::string tmp = path + "." + std::to_string(getpid());
+    std::string out;
+    cache_header header;
+
+    fill_key(&header, filename, st);
+    write_image(&out, &header, filename, tree, NULL);
+
+    std::string dir = _config->FindDir("Inapt::Cache::Directory", "/var/cache/inapt/");
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        debug("mkdir: %s: %s", dir.c_str(), strerror(errno));
+        return;
+    }
+
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        debug("open: %s: %s", tmp.c_str(), strerror(errno));
+        return;
+    }
+
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (fclose(f) || !ok || rename(tmp.c_str(), path.c_str())) {
+        debug("write: %s: %s", tmp.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return;
+    }
+
+    debug("%s: cached in %s", filename, path.c_str());
+}
+
+/* writes a whole evaluated spec and its final actions to fd, for load_spec_image() */
+bool save_spec_image(int fd, inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    std::string out;
+    cache_header header;
+
+    fill_spec_key(&header);
+    write_image(&out, &header, "", tree, final_actions);
+
+    for (size_t done = 0; done < out.size(); ) {
+        ssize_t len = write(fd, out.data() + done, out.size() - done);
+        if (len < 0 && errno != EINTR)
+            return false;
+        if (len > 0)
+            done += len;
+    }
+
+    return true;
+}
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * A drift check that never opens the APT cache: the dpkg status file and
+ * the Packages lists are mapped and scanned once each. That is enough to
+ * tell what each name stands for as the cache would, a real package if it
+ * is installed or a list offers it for this architecture, and otherwise a
+ * virtual package with one provider per package version providing it.
+ * Each directive then picks its alternate with choose_alternate(), as a
+ * run does, and only that package's installed state is compared. Pins,
+ * candidate versions and dependencies play no part.
+ */
+
+#define CHECK_INSTALLED  1      /* unpacked or further along */
+#define CHECK_CONFFILES  2      /* removed, configuration files remain */
+#define CHECK_OFFERED    4      /* in a list, for this architecture */
+
+struct check_name {
+    unsigned flags = 0;
+    unsigned providers = 0;
+    std::string_view provider;      /* the first, so the only one when providers is 1 */
+};
+
+struct check_stanza {
+    std::string_view package, status, version, architecture, provides;
+};
+
+struct check_state {
+    std::unordered_map<std::string_view, check_name> names;
+    std::unordered_set<std::string> provides;      /* name, provider and version, so each version counts once */
+    std::string architecture;
+    std::vector<std::pair<void *, size_t> > mappings;
+};
+
+static std::string_view field_word(std::string_view value, unsigned n) {
+    size_t pos = 0;
+
+    for (;;) {
+        while (pos < value.size() && value[pos] == ' ')
+            pos++;
+        size_t end = value.find(' ', pos);
+        if (end == std::string_view::npos)
+            end = value.size();
+        if (!n--)
+            return value.substr(pos, end - pos);
+        pos = end;
+        if (pos >= value.size())
+            return std::string_view();
+    }
+}
+
+/* the name part of name:arch, which the status file and the lists key packages by */
+static std::string_view base_name(std::string_view name) {
+    return name.substr(0, name.find(':'));
+}
+
+static void add_provides(check_state *state, check_stanza *stanza) {
+    std::string_view provides = stanza->provides;
+
+    while (!provides.empty()) {
+        size_t comma = provides.find(',');
+        std::string_view item = provides.substr(0, comma);
+
+        size_t begin = item.find_first_not_of(' ');
+        if (begin != std::string_view::npos) {
+            item = item.substr(begin);
+            item = item.substr(0, item.find_first_of(" (:"));
+
+            std::string key (item);
+            key.append(1, '\0').append(stanza->package).append(1, '\0').append(stanza->version);
+            if (state->provides.insert(key).second) {
+                check_name *name = &state->names[item];
+                if (!name->providers++)
+                    name->provider = stanza->package;
+            }
+        }
+
+        if (comma == std::string_view::npos)
+            break;
+        provides.remove_prefix(comma + 1);
+    }
+}
+
+/* a list stanza for another architecture stands for name:arch, which no directive names as name */
+static void add_stanza(check_state *state, check_stanza *stanza, bool list) {
+    if (stanza->package.empty())
+        return;
+
+    if (list) {
+        if (stanza->architecture != "all" && stanza->architecture != state->architecture)
+            return;
+        state->names[stanza->package].flags |= CHECK_OFFERED;
+        add_provides(state, stanza);
+        return;
+    }
+
+    std::string_view current = field_word(stanza->status, 2);
+    if (current == "config-files") {
+        state->names[stanza->package].flags |= CHECK_CONFFILES;
+    } else if (!current.empty() && current != "not-installed") {
+        state->names[stanza->package].flags |= CHECK_INSTALLED;
+        add_provides(state, stanza);
+    }
+}
+
+/* one pass over a status file or list; continuation lines of multi-line fields are skipped */
+static void scan_file(check_state *state, const std::string &path, bool list) {
+    struct stat st;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        fatalpe("open: %s", path.c_str());
+    if (fstat(fd, &st))
+        fatalpe("stat: %s", path.c_str());
+    if (!st.st_size) {
+        close(fd);
+        return;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        fatalpe("mmap: %s", path.c_str());
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+    /* the names are views into the file, so it stays mapped until the check is done */
+    state->mappings.push_back(std::make_pair(data, (size_t) st.st_size));
+
+    const char *p = (const char *) data, *end = p + st.st_size;
+    check_stanza stanza;
+
+    while (p < end) {
+        const char *eol = (const char *) memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        std::string_view line (p, eol - p);
+        p = eol + 1;
+
+        if (line.empty()) {
+            add_stanza(state, &stanza, list);
+            stanza = check_stanza();
+        } else if (line.compare(0, 9, "Package: ") == 0) {
+            stanza.package = line.substr(9);
+        } else if (line.compare(0, 8, "Status: ") == 0) {
+            stanza.status = line.substr(8);
+        } else if (line.compare(0, 9, "Version: ") == 0) {
+            stanza.version = line.substr(9);
+        } else if (line.compare(0, 14, "Architecture: ") == 0) {
+            stanza.architecture = line.substr(14);
+        } else if (line.compare(0, 10, "Provides: ") == 0) {
+            stanza.provides = line.substr(10);
+        }
+    }
+
+    add_stanza(state, &stanza, list);
+}
+
+/* every Packages list apt update left; compressed ones (Acquire::GzipIndexes) cannot be mapped */
+static bool scan_lists(check_state *state) {
+    std::string dir = _config->FindDir("Dir::State::lists");
+    static const char *compressed[] = { "gz", "xz", "lz4", "zst", "bz2", "lzma" };
+    bool okay = true;
+    struct dirent *de;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return _error->Errno("opendir", "Unable to read the lists in %s", dir.c_str());
+
+    while ((de = readdir(d))) {
+        std::string_view name (de->d_name);
+        size_t suffix = name.rfind("_Packages");
+        if (suffix == std::string_view::npos)
+            continue;
+
+        std::string_view rest = name.substr(suffix + 9);
+        if (rest.empty()) {
+            scan_file(state, dir + de->d_name, true);
+            continue;
+        }
+        for (unsigned i = 0; i < sizeof(compressed) / sizeof(*compressed); i++) {
+            if (rest.size() > 1 && rest[0] == '.' && rest.substr(1) == compressed[i]) {
+                _error->Error("%s%s is compressed, which --check cannot read", dir.c_str(), de->d_name);
+                okay = false;
+            }
+        }
+    }
+    closedir(d);
+
+    return okay;
+}
+
+/* what resolve_name() would find in the cache */
+static unsigned char name_kind(check_state *state, std::string_view name) {
+    std::unordered_map<std::string_view, check_name>::iterator i = state->names.find(base_name(name));
+
+    if (i == state->names.end())
+        return INAPT_MISSING;
+    if (i->second.flags & (CHECK_INSTALLED | CHECK_OFFERED))
+        return INAPT_REAL;
+    if (!i->second.providers)
+        return INAPT_UNPROVIDED;
+    return i->second.providers == 1 ? INAPT_PROVIDED : INAPT_AMBIGUOUS;
+}
+
+static unsigned name_flags(check_state *state, std::string_view name) {
+    std::unordered_map<std::string_view, check_name>::iterator i = state->names.find(base_name(name));
+    return i == state->names.end() ? 0 : i->second.flags;
+}
+
+/*
+ * Prints one line per drifted action to out and returns the exit status:
+ * 0 when the system matches, 3 when it has drifted and 1 when the lists
+ * could not be read or, with Inapt::Strict, a directive names nothing.
+ * Diagnostics are left queued in _error.
+ */
+int check_drift(inapt_tree *tree, std::vector<inapt_package *> *final_actions, FILE *out) {
+    bool purge = _config->FindB("Inapt::Purge", false);
+    check_state state;
+    unsigned drift = 0;
+    int status = 0;
+
+    state.architecture = _config->Find("APT::Architecture");
+    state.names.reserve(65536);
+    scan_file(&state, _config->FindFile("Dir::State::status"), false);
+
+    if (scan_lists(&state)) {
+        std::vector<unsigned char> kinds (tree->strings.strings.size(), INAPT_MISSING);
+        for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
+            for (unsigned j = (*i)->alternates.begin; j < (*i)->alternates.end; j++)
+                kinds[tree->names[j]] = name_kind(&state, tree->strings.str(tree->names[j]));
+
+        std::vector<unsigned> chosen;
+        for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
+            chosen.push_back(choose_alternate(tree, *i, kinds.data()));
+
+        /* as in a run, a directive that names nothing under Inapt::Strict stops everything */
+        for (unsigned i = 0; i < final_actions->size() && !_error->PendingError(); i++) {
+            inapt_package *package = (*final_actions)[i];
+            if (chosen[i] == NO_ALTERNATE)
+                continue;
+
+            std::string_view name = base_name(tree->strings.str(tree->names[chosen[i]]));
+            if (kinds[tree->names[chosen[i]]] == INAPT_PROVIDED)
+                name = state.names[name].provider;
+
+            unsigned flags = name_flags(&state, name);
+            bool drifted;
+            if (package->action == inapt_action::INSTALL)
+                drifted = !(flags & CHECK_INSTALLED);
+            else
+                drifted = flags & (purge ? CHECK_INSTALLED | CHECK_CONFFILES : CHECK_INSTALLED);
+            if (!drifted)
+                continue;
+
+            fprintf(out, "%s:%d: %s %.*s\n", tree->c_str(package->filename), package->linenum,
+                    package->action == inapt_action::INSTALL ? "missing" : "lingering", (int) name.size(), name.data());
+            drift++;
+        }
+
+        status = _error->PendingError() ? 1 : drift ? 3 : 0;
+    } else {
+        status = 1;
+    }
+
+    for (std::vector<std::pair<void *, size_t> >::iterator i = state.mappings.begin(); i != state.mappings.end(); i++)
+        munmap(i->first, i->second);
+
+    debug("%u of %lu actions drifted", drift, (unsigned long) final_actions->size());
+    return status;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/strutl.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Keeps the archive cache under Inapt::Clean::MaxSize MiB by deleting the
+ * archives used least recently, never those of a version the spec wants
+ * installed. An archive counts as used when it was last read or when a
+ * run last installed from it; the latter is recorded by touching it.
+ */
+
+struct clean_archive {
+    std::string name;
+    off_t size;
+    time_t used;
+
+    bool operator<(const clean_archive &other) const {
+        return used < other.used;
+    }
+};
+
+/* the name pkgAcqArchive stores a version's archive under */
+std::string archive_name(pkgCache::VerIterator version) {
+    return QuoteString(version.ParentPkg().Name(), "_:") + '_' + QuoteString(version.VerStr(), "_:") + '_' +
+           QuoteString(version.Arch(), "_:.") + ".deb";
+}
+
+static void managed_archives(pkgCacheFile &cache, std::vector<inapt_package *> *final_actions,
+                             std::set<std::string> *keep) {
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        pkgCache::PkgIterator k = (*i)->pkg;
+        if (k.end() || (*i)->action != inapt_action::INSTALL)
+            continue;
+
+        if (k.CurrentVer())
+            keep->insert(archive_name(k.CurrentVer()));
+        if (cache[k].Install())
+            keep->insert(archive_name(cache[k].InstVerIter(cache)));
+    }
+}
+
+void clean_archives(pkgCacheFile &cache, std::vector<inapt_package *> *final_actions, inapt_archive_use *use) {
+    std::string dir = _config->FindDir("Dir::Cache::Archives");
+    unsigned long long budget = (unsigned long long) _config->FindI("Inapt::Clean::MaxSize", 256) << 20;
+    unsigned long long total = 0, freed = 0;
+    std::vector<clean_archive> archives;
+    std::set<std::string> keep;
+    unsigned evicted = 0;
+    struct dirent *de;
+    struct stat st;
+
+    FileFd Lock;
+    Lock.Fd(GetLock(dir + "lock"));
+    if (_error->PendingError()) {
+        _error->Error("Unable to lock the download directory");
+        return;
+    }
+
+    for (std::vector<std::string>::iterator i = use->files.begin(); i != use->files.end(); i++)
+        if (utimes(i->c_str(), NULL) && errno != ENOENT)
+            warnpe("utimes: %s", i->c_str());
+
+    managed_archives(cache, final_actions, &keep);
+
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        warnpe("opendir: %s", dir.c_str());
+        return;
+    }
+    while ((de = readdir(d))) {
+        std::string name = de->d_name;
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".deb"))
+            continue;
+        if (lstat((dir + name).c_str(), &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        total += st.st_size;
+        if (keep.count(name))
+            continue;
+
+        clean_archive archive = { name, st.st_size, std::max(st.st_atime, st.st_mtime) };
+        archives.push_back(archive);
+    }
+    closedir(d);
+
+    std::sort(archives.begin(), archives.end());
+    for (std::vector<clean_archive>::iterator i = archives.begin(); i != archives.end() && total > budget; i++) {
+        std::string path = dir + i->name;
+        if (unlink(path.c_str())) {
+            warnpe("unlink: %s", path.c_str());
+            continue;
+        }
+        debug("evicting %s", i->name.c_str());
+        total -= i->size;
+        freed += i->size;
+        evicted++;
+    }
+
+    if (total > budget)
+        warn("archives of managed packages alone take %sB, over the budget of %sB",
+             SizeToStr(total).c_str(), SizeToStr(budget).c_str());
+
+    unsigned requests = use->hits + use->misses;
+    notice("freed %sB in %u archives, %sB remain; %u of %u archives were cached (%.0f%%)",
+           SizeToStr(freed).c_str(), evicted, SizeToStr(total).c_str(), use->hits, requests,
+           requests ? 100.0 * use->hits / requests : 100.0);
+}
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/error.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Finds directives that can never be applied together before anything is
+ * marked: installs whose every possible version conflicts with or breaks
+ * every possible version of another, and installs that depend only on
+ * packages the directives remove. The versions a package could end up at
+ * are its current one and its candidate, the only ones the resolver
+ * chooses from. Only the package cache is read, and whatever cannot be
+ * proven here is left to the resolver.
+ */
+
+struct conflict_target {
+    inapt_package *package;
+    std::vector<pkgCache::VerIterator> versions;
+};
+
+typedef std::pair<pkgCache::Version *, pkgCache::Version *> version_pair;
+
+static void possible_versions(pkgCacheFile &cache, pkgCache::PkgIterator pkg,
+                              std::vector<pkgCache::VerIterator> *versions) {
+    pkgCache::VerIterator current = pkg.CurrentVer();
+    pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+    if (!current.end())
+        versions->push_back(current);
+    if (!candidate.end() && candidate != current)
+        versions->push_back(candidate);
+}
+
+/* records which versions of other targets one Conflicts or Breaks rules out */
+static void find_clashes(pkgCacheFile &cache, std::vector<conflict_target> *targets, std::vector<unsigned> *target_of,
+                         unsigned x, pkgCache::VerIterator version, pkgCache::DepIterator dep,
+                         std::map<std::pair<unsigned, unsigned>, std::set<version_pair> > *clashes) {
+    pkgCache::Version **all = dep.AllTargets();
+
+    for (pkgCache::Version **t = all; *t; t++) {
+        pkgCache::VerIterator other (cache, *t);
+        unsigned y = (*target_of)[other.ParentPkg()->ID];
+        if (y == ~0U || y == x)
+            continue;
+
+        std::vector<pkgCache::VerIterator> *versions = &(*targets)[y].versions;
+        if (std::find(versions->begin(), versions->end(), other) == versions->end())
+            continue;
+
+        if (x < y)
+            (*clashes)[std::make_pair(x, y)].insert(version_pair(version, other));
+        else
+            (*clashes)[std::make_pair(y, x)].insert(version_pair(other, version));
+    }
+
+    delete[] all;
+}
+
+/* the directive removing every package that could satisfy an or-group, if there is one */
+static inapt_package *removed_group(pkgCacheFile &cache, std::vector<inapt_package *> *remove_of,
+                                    pkgCache::DepIterator start, pkgCache::DepIterator end) {
+    inapt_package *remover = NULL;
+
+    for (;;) {
+        pkgCache::Version **all = start.AllTargets();
+        for (pkgCache::Version **t = all; *t; t++) {
+            inapt_package *r = (*remove_of)[pkgCache::VerIterator(cache, *t).ParentPkg()->ID];
+            if (!r) {
+                delete[] all;
+                return NULL;
+            }
+            remover = r;
+        }
+        delete[] all;
+
+        if (start == end)
+            break;
+        start++;
+    }
+
+    return remover;
+}
+
+bool find_conflicts(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
+    unsigned num_packages = cache.GetPkgCache()->Head().PackageCount;
+    std::vector<conflict_target> targets;
+    std::vector<unsigned> target_of (num_packages, ~0U);
+    std::vector<inapt_package *> remove_of (num_packages);
+    std::map<std::pair<unsigned, unsigned>, std::set<version_pair> > clashes;
+    bool okay = true;
+
+    /* a package named twice is sanity_check()'s to report, so only the first directive counts */
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        pkgCache::PkgIterator k = (*i)->pkg;
+        if (k.end() || target_of[k->ID] != ~0U || remove_of[k->ID])
+            continue;
+
+        if ((*i)->action == inapt_action::REMOVE) {
+            remove_of[k->ID] = *i;
+        } else {
+            conflict_target target;
+            target.package = *i;
+            possible_versions(cache, k, &target.versions);
+            target_of[k->ID] = targets.size();
+            targets.push_back(target);
+        }
+    }
+
+    for (unsigned x = 0; x < targets.size(); x++) {
+        inapt_package *package = targets[x].package;
+        inapt_package *remover = NULL;
+        unsigned blocked = 0;
+
+        for (std::vector<pkgCache::VerIterator>::iterator v = targets[x].versions.begin(); v != targets[x].versions.end(); v++) {
+            inapt_package *version_remover = NULL;
+
+            for (pkgCache::DepIterator dep = v->DependsList(); !dep.end(); ) {
+                pkgCache::DepIterator start, end;
+                dep.GlobOr(start, end);
+
+                if (start.IsNegative())
+                    find_clashes(cache, &targets, &target_of, x, *v, start, &clashes);
+                else if (start.IsCritical() && !version_remover)
+                    version_remover = removed_group(cache, &remove_of, start, end);
+            }
+
+            if (version_remover) {
+                remover = version_remover;
+                blocked++;
+            }
+        }
+
+        if (blocked && blocked == targets[x].versions.size()) {
+            _error->Error("%s:%d: %s depends on %s, which %s:%d removes", tree->c_str(package->filename),
+                          package->linenum, package->pkg.Name(), remover->pkg.Name(), tree->c_str(remover->filename),
+                          remover->linenum);
+            okay = false;
+        }
+    }
+
+    /* a pair is unsatisfiable when every combination of their versions clashes, in either direction */
+    for (std::map<std::pair<unsigned, unsigned>, std::set<version_pair> >::iterator i = clashes.begin(); i != clashes.end(); i++) {
+        conflict_target *x = &targets[i->first.first], *y = &targets[i->first.second];
+        if (i->second.size() < x->versions.size() * y->versions.size())
+            continue;
+
+        _error->Error("%s:%d: %s conflicts with %s at %s:%d", tree->c_str(x->package->filename), x->package->linenum,
+                      x->package->pkg.Name(), y->package->pkg.Name(), tree->c_str(y->package->filename),
+                      y->package->linenum);
+        okay = false;
+    }
+
+    debug("conflict analysis: %lu installs, %lu clashing pairs", (unsigned long) targets.size(),
+          (unsigned long) clashes.size());
+    return okay;
+}
@@ -0,0 +1,231 @@
+#include <sys/utsname.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include "inapt.h"
+#include "util.h"
+
+static void eval_action(inapt_tree *tree, inapt_action *action, inapt_profile_set *profiles, std::vector<inapt_package *> *final_actions) {
+    for (unsigned i = action->packages.begin; i < action->packages.end; i++) {
+        if (test_profiles(tree, &tree->packages[i].predicates, profiles))
+            final_actions->push_back(&tree->packages[i]);
+    }
+}
+
+/* each included file is evaluated once, however many includes reach it */
+void eval_block(inapt_tree *tree, unsigned block, inapt_profile_set *profiles, std::vector<bool> *seen,
+                std::vector<inapt_package *> *final_actions) {
+    if (block == NO_BLOCK)
+        return;
+
+    inapt_range actions = tree->blocks[block].actions;
+    for (unsigned i = actions.begin; i < actions.end; i++)
+        if (test_profiles(tree, &tree->actions[i].predicates, profiles))
+            eval_action(tree, &tree->actions[i], profiles, final_actions);
+
+    inapt_range children = tree->blocks[block].children;
+    for (unsigned i = children.begin; i < children.end; i++) {
+        inapt_conditional *cond = &tree->conditionals[i];
+        if (test_profiles(tree, &cond->predicates, profiles))
+            eval_block(tree, cond->then_block, profiles, seen, final_actions);
+        else
+            eval_block(tree, cond->else_block, profiles, seen, final_actions);
+    }
+
+    inapt_range includes = tree->blocks[block].includes;
+    for (unsigned i = includes.begin; i < includes.end; i++) {
+        inapt_include *include = &tree->includes[i];
+        if (!test_profiles(tree, &include->predicates, profiles))
+            continue;
+
+        for (unsigned j = include->files.begin; j < include->files.end; j++) {
+            unsigned root = tree->included[j];
+            if (root != NO_BLOCK && !(*seen)[root]) {
+                (*seen)[root] = true;
+                eval_block(tree, root, profiles, seen, final_actions);
+            }
+        }
+    }
+}
+
+/* the walk of eval_block(), collecting the includes it reaches that are not yet loaded */
+void find_includes(inapt_tree *tree, unsigned block, inapt_profile_set *profiles, std::vector<bool> *seen,
+                   std::vector<unsigned> *pending) {
+    if (block == NO_BLOCK)
+        return;
+
+    inapt_range children = tree->blocks[block].children;
+    for (unsigned i = children.begin; i < children.end; i++) {
+        inapt_conditional *cond = &tree->conditionals[i];
+        if (test_profiles(tree, &cond->predicates, profiles))
+            find_includes(tree, cond->then_block, profiles, seen, pending);
+        else
+            find_includes(tree, cond->else_block, profiles, seen, pending);
+    }
+
+    inapt_range includes = tree->blocks[block].includes;
+    for (unsigned i = includes.begin; i < includes.end; i++) {
+        inapt_include *include = &tree->includes[i];
+        if (!test_profiles(tree, &include->predicates, profiles))
+            continue;
+
+        if (!include->resolved) {
+            pending->push_back(i);
+            continue;
+        }
+
+        for (unsigned j = include->files.begin; j < include->files.end; j++) {
+            unsigned root = tree->included[j];
+            if (root != NO_BLOCK && !(*seen)[root]) {
+                (*seen)[root] = true;
+                find_includes(tree, root, profiles, seen, pending);
+            }
+        }
+    }
+}
+
+bool sanity_check(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    bool okay = true;
+    std::map<std::string, inapt_package *> packages;
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        if ((*i)->pkg.end())
+            continue;
+        if (packages.find((*i)->pkg.Name()) != packages.end()) {
+            inapt_package *first = packages[(*i)->pkg.Name()];
+            inapt_package *current = *i;
+            _error->Error("Multiple directives for package %s at %s:%d and %s:%d",
+                    (*i)->pkg.Name(), tree->c_str(first->filename), first->linenum, tree->c_str(current->filename), current->linenum);
+            okay = false;
+            continue;
+        }
+        packages[(*i)->pkg.Name()] = *i;
+    }
+
+    return okay;
+}
+
+/*
+ * The alternate a directive acts on, given what each name stands for by
+ * string id: the first real package, or for an install the first virtual
+ * package with a single provider. Anything else is skipped. Where no
+ * alternate qualifies, NO_ALTERNATE is returned and the directive is
+ * reported, as an error with Inapt::Strict.
+ */
+unsigned choose_alternate(inapt_tree *tree, inapt_package *package, const unsigned char *kinds) {
+    for (unsigned i = package->alternates.begin; i < package->alternates.end; i++) {
+        std::string_view name = tree->strings.str(tree->names[i]);
+
+        switch (kinds[tree->names[i]]) {
+            case INAPT_MISSING:
+                break;
+            case INAPT_REAL:
+                return i;
+            case INAPT_PROVIDED:
+                if (package->action == inapt_action::INSTALL)
+                    return i;
+                debug("will not remove a provider instead of virtual package %.*s", (int) name.size(), name.data());
+                break;
+            case INAPT_AMBIGUOUS:
+                debug("%.*s is a virtual package", (int) name.size(), name.data());
+                break;
+            case INAPT_UNPROVIDED:
+                debug("%.*s is a virtual package with no provides", (int) name.size(), name.data());
+                break;
+        }
+    }
+
+    const char *filename = tree->c_str(package->filename);
+    bool strict = _config->FindB("Inapt::Strict", false);
+    unsigned i = package->alternates.begin;
+    std::string message (tree->strings.str(tree->names[i++]));
+    while (i != package->alternates.end)
+        message.append(", ").append(tree->strings.str(tree->names[i++]));
+
+    if (package->alternates.end - package->alternates.begin == 1) {
+        if (strict)
+            _error->Error("%s:%d: No such package: %s", filename, package->linenum, message.c_str());
+        else
+            _error->Warning("%s:%d: No such package: %s", filename, package->linenum, message.c_str());
+    } else {
+        if (strict)
+            _error->Error("%s:%d: No alternative available: %s", filename, package->linenum, message.c_str());
+        else
+            _error->Warning("%s:%d: No alternative available: %s", filename, package->linenum, message.c_str());
+    }
+
+    return NO_ALTERNATE;
+}
+
+static void debug_profiles(inapt_tree *tree, inapt_profile_set *profiles) {
+    std::string s = "profiles:";
+
+    for (unsigned i = 0; i < tree->strings.profile_count(); i++) {
+        if (profiles->test(i)) {
+            s.append(" ");
+            s.append(tree->strings.profile_name(i));
+        }
+    }
+
+    debug("%s", s.c_str());
+}
+
+static void auto_profiles(inapt_tree *tree, inapt_profile_set *profiles) {
+    struct utsname uts;
+    if (uname(&uts))
+        fatalpe("uname");
+    unsigned id = tree->strings.intern_copy(uts.nodename);
+    profiles->set(tree->strings.profile(tree->strings.str(id)));
+}
+
+/*
+ * Evaluates a parsed spec for this host: the profiles named, the host's
+ * own, and those the spec selects, then every directive that applies.
+ * Includes are loaded as the profiles settle: each round loads the ones
+ * reachable under the profiles so far and starts over, since the new
+ * files may enable more. Files under false branches are never read.
+ */
+void eval_spec(inapt_tree *tree, std::vector<const char *> *profile_names, std::vector<inapt_package *> *final_actions) {
+    inapt_profile_set profiles;
+    inapt_profile_graph graph;
+
+    for (std::vector<const char *>::iterator i = profile_names->begin(); i != profile_names->end(); i++)
+        profiles.set(tree->strings.profile(*i));
+
+    auto_profiles(tree, &profiles);
+
+    telemetry_begin("profiles");
+    inapt_profile_set initial = profiles;
+    for (;;) {
+        std::vector<unsigned> pending;
+        std::vector<bool> seen (tree->blocks.size());
+
+        graph = inapt_profile_graph();
+        profiles = initial;
+        build_profile_graph(tree, &graph);
+        eval_profiles(tree, &graph, &profiles);
+
+        for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+            seen[*i] = true;
+        for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+            find_includes(tree, *i, &profiles, &seen, &pending);
+        if (pending.empty())
+            break;
+        load_includes(tree, &pending);
+    }
+    telemetry_end();
+
+    std::vector<bool> seen (tree->blocks.size());
+    debug_profiles(tree, &profiles);
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+        seen[*i] = true;
+    telemetry_begin("eval");
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++)
+        eval_block(tree, *i, &profiles, &seen, final_actions);
+    telemetry_end();
+    telemetry_count("directives_evaluated", final_actions->size());
+}
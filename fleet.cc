@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Fleet evaluation is bit-sliced: every profile holds one bit per host for
+ * a batch of hosts, so testing a clause for the whole batch is a handful of
+ * vector operations instead of one walk of the tree per host.
+ */
+
+typedef unsigned long lanes_t __attribute__((vector_size(32)));
+
+#define LANE_BITS (8 * sizeof(lanes_t))
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+struct fleet_host {
+    std::string name;
+    std::vector<std::string> profiles;
+};
+
+/* a spec with the common and per-host profiles interned into its tree */
+struct fleet_spec {
+    inapt_tree *tree;
+    inapt_profile_graph graph;
+    std::vector<unsigned> common;
+    std::vector<std::vector<unsigned> > hosts;
+};
+
+struct fleet_result {
+    std::vector<inapt_package *> packages;
+};
+
+static inline bool lanes_any(const lanes_t &v) {
+    unsigned long any = 0;
+    for (unsigned i = 0; i < sizeof(lanes_t) / sizeof(unsigned long); i++)
+        any |= v[i];
+    return any != 0;
+}
+
+/* lanes_t is passed by reference throughout; passing it by value changes the ABI without AVX */
+static inline void lanes_test(inapt_tree *tree, inapt_predicate *predicate, std::vector<lanes_t> *profiles, lanes_t *mask) {
+    for (unsigned i = predicate->clauses.begin; i < predicate->clauses.end && lanes_any(*mask); i++) {
+        lanes_t clause = { 0 };
+        for (unsigned k = tree->clauses[i].begin; k < tree->clauses[i].end; k++) {
+            unsigned term = tree->terms[k];
+            clause |= (term & 1) ? ~(*profiles)[term >> 1] : (*profiles)[term >> 1];
+        }
+        *mask &= clause;
+    }
+}
+
+static void lanes_rule(inapt_tree *tree, inapt_profile_rule *rule, std::vector<lanes_t> *profiles, lanes_t *mask) {
+    for (std::vector<inapt_predicate *>::iterator i = rule->guards.begin(); i != rule->guards.end(); i++)
+        lanes_test(tree, *i, profiles, mask);
+
+    for (std::vector<inapt_predicate *>::iterator i = rule->unless.begin(); i != rule->unless.end(); i++) {
+        lanes_t match = *mask;
+        lanes_test(tree, *i, profiles, &match);
+        *mask &= ~match;
+    }
+}
+
+/* eval_profiles() for a batch: a rule is re-tested whenever a watched profile gains a host */
+static void lanes_profiles(inapt_tree *tree, inapt_profile_graph *graph, std::vector<lanes_t> *profiles, const lanes_t &hosts) {
+    std::vector<bool> queued (graph->rules.size());
+    std::vector<unsigned> worklist;
+
+    for (unsigned s = 0; s < graph->strata.size(); s++) {
+        worklist.assign(graph->strata[s].rbegin(), graph->strata[s].rend());
+        for (std::vector<unsigned>::iterator i = worklist.begin(); i != worklist.end(); i++)
+            queued[*i] = true;
+
+        while (!worklist.empty()) {
+            unsigned r = worklist.back();
+            worklist.pop_back();
+            queued[r] = false;
+
+            lanes_t fired = hosts;
+            lanes_rule(tree, &graph->rules[r], profiles, &fired);
+            if (!lanes_any(fired))
+                continue;
+
+            inapt_range enabled = graph->rules[r].profiles->profiles;
+            for (unsigned i = enabled.begin; i < enabled.end; i++) {
+                lanes_t &profile = (*profiles)[tree->enables[i]];
+                if (!lanes_any(fired & ~profile))
+                    continue;
+                profile |= fired;
+
+                std::vector<unsigned> &watchers = graph->watchers[tree->enables[i]];
+                for (std::vector<unsigned>::iterator j = watchers.begin(); j != watchers.end(); j++) {
+                    if (graph->rules[*j].stratum == s && !queued[*j]) {
+                        queued[*j] = true;
+                        worklist.push_back(*j);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void lanes_collect(inapt_package *package, const lanes_t &mask, fleet_result *results) {
+    for (unsigned w = 0; w < LANE_BITS / WORD_BITS; w++)
+        for (unsigned long bits = mask[w]; bits; bits &= bits - 1)
+            results[w * WORD_BITS + __builtin_ctzl(bits)].packages.push_back(package);
+}
+
+/* eval_block() for a batch */
+static void lanes_block(inapt_tree *tree, unsigned block, std::vector<lanes_t> *profiles, const lanes_t &mask, fleet_result *results) {
+    if (block == NO_BLOCK || !lanes_any(mask))
+        return;
+
+    inapt_range actions = tree->blocks[block].actions;
+    for (unsigned i = actions.begin; i < actions.end; i++) {
+        lanes_t action = mask;
+        lanes_test(tree, &tree->actions[i].predicates, profiles, &action);
+        if (!lanes_any(action))
+            continue;
+
+        inapt_range packages = tree->actions[i].packages;
+        for (unsigned j = packages.begin; j < packages.end; j++) {
+            lanes_t package = action;
+            lanes_test(tree, &tree->packages[j].predicates, profiles, &package);
+            if (lanes_any(package))
+                lanes_collect(&tree->packages[j], package, results);
+        }
+    }
+
+    inapt_range children = tree->blocks[block].children;
+    for (unsigned i = children.begin; i < children.end; i++) {
+        inapt_conditional *cond = &tree->conditionals[i];
+        lanes_t then_mask = mask;
+        lanes_test(tree, &cond->predicates, profiles, &then_mask);
+        lanes_t else_mask = mask & ~then_mask;
+        lanes_block(tree, cond->then_block, profiles, then_mask, results);
+        lanes_block(tree, cond->else_block, profiles, else_mask, results);
+    }
+
+    /* a file reached through several includes is collected more than once, which format_result() folds */
+    inapt_range includes = tree->blocks[block].includes;
+    for (unsigned i = includes.begin; i < includes.end; i++) {
+        inapt_include *include = &tree->includes[i];
+        lanes_t include_mask = mask;
+        lanes_test(tree, &include->predicates, profiles, &include_mask);
+        for (unsigned j = include->files.begin; j < include->files.end; j++)
+            lanes_block(tree, tree->included[j], profiles, include_mask, results);
+    }
+}
+
+static void eval_batch(fleet_spec *spec, unsigned first, fleet_result *results) {
+    unsigned count = std::min<size_t>(LANE_BITS, spec->hosts.size() - first);
+    lanes_t none = { 0 }, all = { 0 };
+    std::vector<lanes_t> profiles (spec->tree->strings.profile_count(), none);
+
+    for (unsigned h = 0; h < count; h++)
+        all[h / WORD_BITS] |= 1UL << (h % WORD_BITS);
+
+    for (std::vector<unsigned>::iterator i = spec->common.begin(); i != spec->common.end(); i++)
+        profiles[*i] = all;
+
+    for (unsigned h = 0; h < count; h++) {
+        std::vector<unsigned> &host_profiles = spec->hosts[first + h];
+        for (std::vector<unsigned>::iterator i = host_profiles.begin(); i != host_profiles.end(); i++)
+            profiles[*i][h / WORD_BITS] |= 1UL << (h % WORD_BITS);
+    }
+
+    lanes_profiles(spec->tree, &spec->graph, &profiles, all);
+    for (std::vector<unsigned>::iterator i = spec->tree->roots.begin(); i != spec->tree->roots.end(); i++)
+        lanes_block(spec->tree, *i, &profiles, all, results);
+}
+
+static std::string package_name(inapt_tree *tree, inapt_package *package) {
+    std::string name;
+
+    for (unsigned i = package->alternates.begin; i < package->alternates.end; i++) {
+        if (i != package->alternates.begin)
+            name.append("/");
+        name.append(tree->strings.str(tree->names[i]));
+    }
+
+    return name;
+}
+
+static std::string format_result(inapt_tree *tree, fleet_result *result) {
+    std::vector<std::string> install, remove;
+    std::string s;
+
+    for (std::vector<inapt_package *>::iterator i = result->packages.begin(); i != result->packages.end(); i++) {
+        if ((*i)->action == inapt_action::INSTALL)
+            install.push_back(package_name(tree, *i));
+        else
+            remove.push_back(package_name(tree, *i));
+    }
+
+    std::sort(install.begin(), install.end());
+    install.erase(std::unique(install.begin(), install.end()), install.end());
+    std::sort(remove.begin(), remove.end());
+    remove.erase(std::unique(remove.begin(), remove.end()), remove.end());
+
+    s.append(" install");
+    for (std::vector<std::string>::iterator i = install.begin(); i != install.end(); i++)
+        s.append(" ").append(*i);
+    s.append("; remove");
+    for (std::vector<std::string>::iterator i = remove.begin(); i != remove.end(); i++)
+        s.append(" ").append(*i);
+    s.append(";");
+
+    return s;
+}
+
+static void read_hosts(const char *filename, std::vector<fleet_host> *hosts) {
+    std::ifstream in (filename);
+    std::string line;
+    int linenum = 0;
+
+    if (!in)
+        fatalpe("open: %s", filename);
+
+    while (std::getline(in, line)) {
+        linenum++;
+
+        std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words (line);
+        std::string word;
+        if (!(words >> word))
+            continue;
+
+        fleet_host host;
+        host.name = word;
+        host.profiles.push_back(word);
+        while (words >> word)
+            host.profiles.push_back(word);
+        hosts->push_back(host);
+    }
+
+    if (in.bad())
+        fatalpe("read: %s", filename);
+
+    debug("%s: %d lines, %lu hosts", filename, linenum, (unsigned long) hosts->size());
+}
+
+/* hosts may take any branch, so every include is loaded up front */
+static void prepare_spec(fleet_spec *spec, inapt_tree *tree, std::vector<fleet_host> *hosts, std::vector<const char *> *common) {
+    spec->tree = tree;
+    load_all_includes(tree);
+
+    for (std::vector<const char *>::iterator i = common->begin(); i != common->end(); i++)
+        spec->common.push_back(tree->strings.profile(*i));
+
+    spec->hosts.resize(hosts->size());
+    for (unsigned h = 0; h < hosts->size(); h++) {
+        std::vector<std::string> &names = (*hosts)[h].profiles;
+        for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); i++)
+            spec->hosts[h].push_back(tree->strings.profile(tree->strings.str(tree->strings.intern_copy(*i))));
+    }
+
+    /* every profile is interned now, so the graph can be sized */
+    build_profile_graph(tree, &spec->graph);
+}
+
+/*
+ * Evaluates the spec for every host listed in filename and prints each
+ * host's final install and remove sets. With a baseline spec, only hosts
+ * whose sets differ between the two are printed.
+ */
+void eval_fleet(const char *filename, inapt_tree *tree, inapt_tree *baseline, std::vector<const char *> *common) {
+    std::vector<fleet_host> hosts;
+    fleet_spec spec, base;
+
+    read_hosts(filename, &hosts);
+
+    prepare_spec(&spec, tree, &hosts, common);
+    if (baseline)
+        prepare_spec(&base, baseline, &hosts, common);
+
+    std::vector<std::string> output (hosts.size());
+    unsigned num_batches = (hosts.size() + LANE_BITS - 1) / LANE_BITS;
+
+    auto eval_hosts = [&](unsigned b) {
+        fleet_result results[LANE_BITS], base_results[LANE_BITS];
+        unsigned first = b * LANE_BITS;
+        unsigned count = std::min<size_t>(LANE_BITS, hosts.size() - first);
+
+        eval_batch(&spec, first, results);
+        if (baseline)
+            eval_batch(&base, first, base_results);
+
+        for (unsigned h = 0; h < count; h++) {
+            std::string result = format_result(tree, &results[h]);
+            if (baseline && result == format_result(baseline, &base_results[h]))
+                continue;
+            output[first + h] = hosts[first + h].name + result + "\n";
+        }
+    };
+
+    parallel_for(num_batches, _config->FindI("Inapt::Fleet::Threads", std::thread::hardware_concurrency()), eval_hosts);
+
+    for (std::vector<std::string>::iterator i = output.begin(); i != output.end(); i++)
+        fputs(i->c_str(), stdout);
+}
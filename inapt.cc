@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <getopt.h>
-#include <sys/utsname.h>
 #include <iostream>
 #include <cstdio>
 #include <fstream>
-#include <set>
+#include <random>
 #include <apt-pkg/pkgcache.h>
 #include <apt-pkg/cachefile.h>
 #include <apt-pkg/progress.h>
@@ -14,6 +16,9 @@
 #include <apt-pkg/algorithms.h>
 #include <apt-pkg/sptr.h>
 #include <apt-pkg/acquire-item.h>
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/pkgrecords.h>
+#include <apt-pkg/sourcelist.h>
 
 #include "inapt.h"
 #include "util.h"
@@ -32,17 +37,18 @@ static struct option opts[] = {
     { "clean", 0, NULL, 'e' },
     { "option", 0, NULL, 'o' },
     { "strict", 0, NULL, 't' },
+    { "fleet", 1, NULL, 'F' },
+    { "baseline", 1, NULL, 'b' },
+    { "force", 0, NULL, 'f' },
+    { "prestage", 0, NULL, 'P' },
+    { "agent", 0, NULL, 'A' },
+    { "lint", 0, NULL, 'L' },
     { NULL, 0, NULL, '\0' },
 };
 
-static bool run_install(pkgCacheFile &cache) {
-   if (_config->FindB("Inapt::Purge", false))
-      for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++)
-         if (!i.Purge() && cache[i].Mode == pkgDepCache::ModeDelete)
-            cache->MarkDelete(i, true);
-
+static bool run_install(pkgCacheFile &cache, inapt_archive_use *use) {
    if (cache->BrokenCount())
-       fatal("broken packages during install");
+       return _error->Error("Broken packages during install");
 
    if (!cache->DelCount() && !cache->InstCount() && !cache->BadCount())
       return true;
@@ -56,11 +62,17 @@ static bool run_install(pkgCacheFile &cache) {
    if (_error->PendingError())
        return _error->Error("Unable to lock the download directory");
 
+   /* a prestaged plan has every archive in place already, so the fetch below only checks them */
+   std::string plan = plan_fingerprint(cache);
+   bool prestaged = !_config->FindB("Inapt::Prestage", false) && plan == read_state("prestaged");
+   if (prestaged)
+      debug("plan %s was prestaged", plan.c_str());
+
    pkgAcquire Fetcher;
 
    unsigned int width = 80;
    AcqTextStatus status (width, 0);
-   Fetcher.Setup(&status);
+   Fetcher.Setup(prestaged ? NULL : &status);
 
    pkgSourceList List;
    if (List.ReadMainList() == false)
@@ -71,190 +83,171 @@ static bool run_install(pkgCacheFile &cache) {
        _error->PendingError())
       return false;
 
-  if (Fetcher.Run() == pkgAcquire::Failed)
+  telemetry_begin("fetch");
+  pkgAcquire::RunResult Fetched = Fetcher.Run();
+  telemetry_end();
+  telemetry_count("bytes_fetched", status.FetchedBytes);
+  if (Fetched == pkgAcquire::Failed)
      return false;
 
   bool Failed = false;
   for (pkgAcquire::ItemIterator i = Fetcher.ItemsBegin(); i != Fetcher.ItemsEnd(); i++) {
-     if ((*i)->Status != pkgAcquire::Item::StatDone || (*i)->Complete != true)
+     if ((*i)->Status != pkgAcquire::Item::StatDone || (*i)->Complete != true) {
          Failed = true;
+         continue;
+     }
+     use->files.push_back((*i)->DestFile);
+     if ((*i)->Local && !use->prefetched.count((*i)->DestFile))
+         use->hits++;
+     else
+         use->misses++;
   }
 
   if (Failed)
      return _error->Error("Unable to fetch some archives");
 
-  _system->UnLock();
-
-  pkgPackageManager::OrderResult Res = PM->DoInstall(-1);
-  if (Res == pkgPackageManager::Completed)
+  if (_config->FindB("Inapt::Prestage", false)) {
+     debug("prestaged plan %s", plan.c_str());
+     write_state("prestaged", plan);
      return true;
+  }
 
-  return false;
-}
-
-static void run_autoremove(pkgCacheFile &cache) {
-    bool purge = _config->FindB("Inapt::Purge", false);
+  _system->UnLock();
 
-    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
-        if (cache[i].Garbage) {
-            debug("autoremove: %s", i.Name());
-            cache->MarkDelete(i, purge);
-        }
-    }
+  telemetry_begin("install");
+  pkgPackageManager::OrderResult Res = PM->DoInstall(-1);
+  telemetry_end();
+  if (Res != pkgPackageManager::Completed)
+     return _error->Error("The installation did not complete");
 
-    if (cache->BrokenCount())
-        fatal("automatic removal broke packages");
+  if (prestaged)
+     clear_state("prestaged");
+  return true;
 }
 
-static void usage() {
-    fprintf(stderr, "Usage: %s [options] [filename..]\n", prog);
-    exit(2);
-}
+/* counts the lists that were actually transferred, as opposed to confirmed unchanged */
+class UpdateStatus : public AcqTextStatus {
+    public:
 
-static bool test_profile(const char *profile, std::set<std::string> *profiles) {
-    return (*profile != '!' && profiles->find(profile) != profiles->end())
-            || (*profile == '!' && profiles->find(profile + 1) == profiles->end());
-}
+    unsigned changed;
 
-static bool test_anyprofile(std::string &profile, std::set<std::string> *profiles) {
-    char *s = xstrdup(profile.c_str());
-    const char *c = strtok(s, "/");
+    UpdateStatus(unsigned int &width) : AcqTextStatus(width, 0), changed(0) { }
 
-    if (test_profile(c, profiles)) {
-        free(s);
-        return true;
+    void Done(pkgAcquire::ItemDesc &desc) {
+        AcqTextStatus::Done(desc);
+        changed++;
     }
+};
 
-    while ((c = strtok(NULL, "/")) != NULL) {
-        if (test_profile(c, profiles)) {
-            free(s);
+/*
+ * Refreshes the package lists unless the last refresh is younger than
+ * Inapt::Update::MaxAge minutes. Apt sends If-Modified-Since for every
+ * list it has and uses index diffs where the archive offers them, so an
+ * unchanged list costs one request and is left alone on disk; the cache
+ * is then only rebuilt if some list was replaced or dropped.
+ */
+static bool update_lists() {
+    int max_age = _config->FindI("Inapt::Update::MaxAge", 0);
+    time_t now = time(NULL);
+
+    if (max_age > 0) {
+        time_t last = atol(read_state("updated").c_str());
+        if (last && now >= last && now - last < max_age * 60) {
+            debug("lists updated %ld minutes ago, not updating", (long) (now - last) / 60);
             return true;
         }
     }
 
-    free(s);
-    return false;
-}
+    if (_config->FindB("Inapt::Simulate", false)) {
+        debug("not updating lists in a simulation");
+        return true;
+    }
 
-static pkgCache::PkgIterator eval_pkg(inapt_package *package, pkgCacheFile &cache) {
-    pkgCache::PkgIterator pkg;
+    pkgSourceList List;
+    if (!List.ReadMainList())
+        return _error->Error("The list of sources could not be read");
 
-    for (std::vector<std::string>::iterator i = package->alternates.begin(); i != package->alternates.end(); i++) {
-        pkgCache::PkgIterator tmp = cache->FindPkg(*i);
+    FileFd Lock;
+    Lock.Fd(GetLock(_config->FindDir("Dir::State::Lists") + "lock"));
+    if (_error->PendingError())
+        return _error->Error("Unable to lock the list directory");
 
-        /* no such package */
-        if (tmp.end())
-            continue;
+    unsigned int width = 80;
+    UpdateStatus status (width);
+    pkgAcquire Fetcher;
+    Fetcher.Setup(&status);
 
-        /* real package */
-        if (cache[tmp].CandidateVer) {
-            pkg = tmp;
-            break;
-        }
+    if (!List.GetIndexes(&Fetcher) || Fetcher.Run() == pkgAcquire::Failed)
+        return false;
 
-        /* virtual package */
-        if (tmp->ProvidesList) {
-            if (!tmp.ProvidesList()->NextProvides) {
-                pkgCache::PkgIterator provide = tmp.ProvidesList().OwnerPkg();
-                if (package->action == inapt_action::INSTALL) {
-                    debug("selecting %s instead of %s", provide.Name(), tmp.Name());
-                    pkg = provide;
-                    break;
-                } else {
-                    debug("will not remove %s instead of virtual package %s", provide.Name(), tmp.Name());
-                }
-            } else {
-                debug("%s is a virtual package", tmp.Name());
-            }
-        } else {
-            debug("%s is a virtual packages with no provides", tmp.Name());
-        }
+    bool Failed = false;
+    for (pkgAcquire::ItemIterator i = Fetcher.ItemsBegin(); i != Fetcher.ItemsEnd(); i++) {
+        if ((*i)->Status == pkgAcquire::Item::StatDone)
+            continue;
+        _error->Warning("Failed to fetch %s %s", (*i)->DescURI().c_str(), (*i)->ErrorText.c_str());
+        Failed = true;
     }
 
-    if (pkg.end()) {
-        if (package->alternates.size() == 1) {
-	    if (_config->FindB("Inapt::Strict", false))
-		    _error->Error("%s:%d: No such package: %s", package->filename, package->linenum, package->alternates[0].c_str());
-	    else
-		    _error->Warning("%s:%d: No such package: %s", package->filename, package->linenum, package->alternates[0].c_str());
-        } else {
-            std::vector<std::string>::iterator i = package->alternates.begin();
-            std::string message = *(i++);
-            while (i != package->alternates.end()) {
-                message.append(", ").append(*(i++));
-            }
-	    if (_config->FindB("Inapt::Strict", false))
-		    _error->Error("%s:%d: No alternative available: %s", package->filename, package->linenum, message.c_str());
-	    else
-		    _error->Warning("%s:%d: No alternative available: %s", package->filename, package->linenum, message.c_str());
-        }
-    }
+    /* lists of sources no longer configured go, which only then changes the directory */
+    if (!Fetcher.Clean(_config->FindDir("Dir::State::Lists")) ||
+        !Fetcher.Clean(_config->FindDir("Dir::State::Lists") + "partial/"))
+        return false;
 
-    return pkg;
-}
+    debug("%u lists changed", status.changed);
+    if (Failed)
+        return _error->Error("Some index files failed to download");
 
-static bool test_profiles(vector<std::string> *test_profiles, std::set<std::string> *profiles) {
-    bool ok = true;
-    for (vector<std::string>::iterator j = test_profiles->begin(); j < test_profiles->end(); j++) {
-        if (!test_anyprofile(*j, profiles)) {
-            ok = false;
-            break;
-        }
-    }
-    return ok;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", (long) now);
+    write_state("updated", buf);
+    return true;
 }
 
-static void eval_action(inapt_action *action, std::set<std::string> *profiles, std::vector<inapt_package *> *final_actions) {
-    for (vector<inapt_package *>::iterator i = action->packages.begin(); i < action->packages.end(); i++) {
-        if (test_profiles(&(*i)->predicates, profiles))
-            final_actions->push_back(*i);
-    }
-}
+/*
+ * The one pass over the whole cache after MarkAndSweep: autoremoval, the
+ * essential package check and, for a real run with purging, turning every
+ * removal into a purge. Marking a package never changes another's mode,
+ * so doing all three per package matches doing them in separate passes.
+ */
+static bool sweep_packages(pkgCacheFile &cache) {
+    bool purge = _config->FindB("Inapt::Purge", false);
+    bool purge_all = purge && !_config->FindB("Inapt::Simulate", false);
+    bool okay = true;
 
-static void eval_block(inapt_block *block, std::set<std::string> *profiles, std::vector<inapt_package *> *final_actions) {
-    if (!block)
-        return;
+    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
+        if (cache[i].Garbage) {
+            debug("autoremove: %s", i.Name());
+            cache->MarkDelete(i, purge);
+        }
 
-    for (vector<inapt_action *>::iterator i = block->actions.begin(); i < block->actions.end(); i++)
-        if (test_profiles(&(*i)->predicates, profiles))
-            eval_action(*i, profiles, final_actions);
+        if (cache[i].Delete() && (i->Flags & pkgCache::Flag::Essential || i->Flags & pkgCache::Flag::Important)) {
+            _error->Error("Removing essential package %s", i.Name());
+            okay = false;
+        }
 
-    for (vector<inapt_conditional *>::iterator i = block->children.begin(); i < block->children.end(); i++) {
-        if (test_profiles(&(*i)->predicates, profiles))
-            eval_block((*i)->then_block, profiles, final_actions);
-        else
-            eval_block((*i)->else_block, profiles, final_actions);
+        if (purge_all && !i.Purge() && cache[i].Mode == pkgDepCache::ModeDelete)
+            cache->MarkDelete(i, true);
     }
-}
 
-static void eval_profiles(inapt_block *block, std::set<std::string> *profiles) {
-    if (!block)
-        return;
-
-    for (vector<inapt_profiles *>::iterator i = block->profiles.begin(); i < block->profiles.end(); i++)
-        if (test_profiles(&(*i)->predicates, profiles))
-            for (vector<std::string>::iterator j = (*i)->profiles.begin(); j != (*i)->profiles.end(); j++)
-                profiles->insert(*j);
+    if (cache->BrokenCount())
+        return _error->Error("Automatic removal broke packages");
 
-    for (vector<inapt_conditional *>::iterator i = block->children.begin(); i < block->children.end(); i++) {
-        if (test_profiles(&(*i)->predicates, profiles))
-            eval_profiles((*i)->then_block, profiles);
-        else
-            eval_profiles((*i)->else_block, profiles);
-    }
+    return okay;
 }
 
-static void dump_nondownloadable(pkgCacheFile &cache) {
-    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++)
-       if (i.CurrentVer() && !i.CurrentVer().Downloadable())
-           debug("package %s version %s is not downloadable", i.Name(), i.CurrentVer().VerStr());
+static void usage() {
+    fprintf(stderr, "Usage: %s [options] [filename..]\n", prog);
+    exit(2);
 }
 
+/* walks the whole cache only to print, so callers check debug_level first */
 static void dump_actions(pkgCacheFile &cache) {
     debug("inst %lu del %lu keep %lu broken %lu bad %lu",
             cache->InstCount(), cache->DelCount(), cache->KeepCount(),
             cache->BrokenCount(), cache->BadCount());
     for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
+       if (i.CurrentVer() && !i.CurrentVer().Downloadable())
+           debug("package %s version %s is not downloadable", i.Name(), i.CurrentVer().VerStr());
        if (cache[i].Install())
          debug("installing %s", i.Name());
        if (cache[i].Delete())
@@ -266,34 +259,6 @@ static void dump_actions(pkgCacheFile &cache) {
     }
 }
 
-static bool sanity_check(std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
-    bool okay = true;
-    std::map<std::string, inapt_package *> packages;
-
-    for (vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
-	if ((*i)->pkg.end())
-		continue;
-        if (packages.find((*i)->pkg.Name()) != packages.end()) {
-            inapt_package *first = packages[(*i)->pkg.Name()];
-            inapt_package *current = *i;
-            _error->Error("Multiple directives for package %s at %s:%d and %s:%d",
-                    (*i)->pkg.Name(), first->filename, first->linenum, current->filename, current->linenum);
-            okay = false;
-            continue;
-        }
-        packages[(*i)->pkg.Name()] = *i;
-    }
-
-    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
-        if (cache[i].Delete() && (i->Flags & pkgCache::Flag::Essential || i->Flags & pkgCache::Flag::Important)) {
-            _error->Error("Removing essential package %s", i.Name());
-            okay = false;
-        }
-    }
-
-    return okay;
-}
-
 static void show_breakage(pkgCacheFile &cache) {
     std::string broken;
     for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++)
@@ -303,81 +268,10 @@ static void show_breakage(pkgCacheFile &cache) {
     _error->Error("Broken packages:%s", broken.c_str());
 }
 
-static void exec_actions(std::vector<inapt_package *> *final_actions) {
-    int marked = 0;
-    bool purge = _config->FindB("Inapt::Purge", false);
-
-    pkgInitConfig(*_config);
-    pkgInitSystem(*_config, _system);
-
-    OpTextProgress prog;
-    pkgCacheFile cache;
-
-    if (cache.Open(&prog, true) == false)
-        return;
-
-    pkgDepCache::ActionGroup group (cache);
-
-    for (vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
-        (*i)->pkg = eval_pkg(*i, cache);
-
-    if (_error->PendingError())
-        return;
-    _error->DumpErrors();
-
-    // preliminary loop (auto-installs, includes recommends - could do this manually)
-    for (vector<inapt_package *>::iterator i = final_actions->begin(); i < final_actions->end(); i++) {
-        pkgCache::PkgIterator k = (*i)->pkg;
-	if (k.end())
-		continue;
-        switch ((*i)->action) {
-            case inapt_action::INSTALL:
-                if (!k.CurrentVer() || cache[k].Delete()) {
-                    debug("install %s %s:%d", (*i)->pkg.Name(), (*i)->filename, (*i)->linenum);
-                    cache->MarkInstall(k, true);
-                }
-                break;
-            case inapt_action::REMOVE:
-                break;
-            default:
-                fatal("uninitialized action");
-        }
-    }
-
-    // secondary loop (removes package and reinstalls auto-removed packages)
-    for (vector<inapt_package *>::iterator i = final_actions->begin(); i < final_actions->end(); i++) {
-        pkgCache::PkgIterator k = (*i)->pkg;
-	if (k.end())
-		continue;
-        switch ((*i)->action) {
-            case inapt_action::INSTALL:
-                if ((!k.CurrentVer() && !cache[k].Install()) || cache[k].Delete()) {
-                    debug("force install %s %s:%d", (*i)->pkg.Name(), (*i)->filename, (*i)->linenum);
-                    cache->MarkInstall(k, false);
-                }
-                if (cache[k].Flags & pkgCache::Flag::Auto) {
-                    debug("marking %s as manually installed", (*i)->pkg.Name());
-                    cache->MarkAuto(k, false);
-                    marked++;
-                }
-                break;
-            case inapt_action::REMOVE:
-                if ((k.CurrentVer() && !cache[k].Delete()) || cache[k].Install())
-                    debug("remove %s %s:%d", (*i)->pkg.Name(), (*i)->filename, (*i)->linenum);
-
-                /* always mark so purge works */
-                cache->MarkDelete(k, purge);
-                break;
-            default:
-                fatal("uninitialized action");
-        }
-    }
-
-    if (_error->PendingError())
-        return;
-
-    dump_nondownloadable(cache);
-    dump_actions(cache);
+/* everything between marking and installing; false if there is nothing to install */
+static bool resolve_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
+    if (debug_level)
+        dump_actions(cache);
 
     if (cache->BrokenCount()) {
         pkgProblemResolver fix (cache);
@@ -387,29 +281,81 @@ static void exec_actions(std::vector<inapt_package *> *final_actions) {
                 continue;
             fix.Protect(k);
         }
+        telemetry_begin("resolve");
         fix.Resolve();
+        telemetry_end();
 
         if (cache->BrokenCount()) {
             show_breakage(cache);
-            return;
+            return false;
         }
     }
 
+    telemetry_begin("mark_and_sweep");
     cache->MarkAndSweep();
-    run_autoremove(cache);
+    telemetry_end();
 
-    if (!sanity_check(final_actions, cache))
-        return;
+    bool okay = sanity_check(tree, final_actions);
+    return sweep_packages(cache) && okay;
+}
+
+/* the transaction a run would make, marked on an open cache; false if it cannot be made */
+bool plan_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
+    pkgDepCache::ActionGroup group (cache);
+    int marked = 0;
+
+    return mark_actions(tree, final_actions, cache, &marked) && resolve_actions(tree, final_actions, cache);
+}
+
+/*
+ * True only once the whole transaction is in place, or would be for a
+ * simulation or prestaging. A real run also records the fingerprint and
+ * the journal here, while the cache the directives were resolved on is
+ * still open.
+ */
+bool exec_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    int marked = 0;
+
+    OpTextProgress prog;
+    pkgCacheFile cache;
+
+    telemetry_begin("cache_open");
+    bool opened = cache.Open(&prog, true);
+    telemetry_end();
+    if (!opened)
+        return false;
+
+    pkgDepCache::ActionGroup group (cache);
+
+    if (!mark_actions(tree, final_actions, cache, &marked))
+        return false;
+    /* shown before the transaction's own output, as soon as the directives are resolved */
+    _error->DumpErrors();
+
+    inapt_archive_use use;
+    inapt_prefetch *prefetch = start_prefetch(final_actions, cache);
+    bool ready = resolve_actions(tree, final_actions, cache);
+    finish_prefetch(prefetch, cache, &use, ready);
+    if (!ready)
+        return false;
+    telemetry_count("packages_marked", cache->InstCount() + cache->DelCount());
 
     if (_config->FindB("Inapt::Simulate", false)) {
         pkgSimulate PM (cache);
         PM.DoInstall(-1);
-        return;
+        return true;
     }
 
-    run_install(cache);
-    if (_error->PendingError())
-        return;
+    if (!run_install(cache, &use) || _error->PendingError())
+        return false;
+    if (_config->FindB("Inapt::Prestage", false))
+        return true;
+
+    telemetry_count("archives_reused", use.hits);
+    telemetry_count("archives_fetched", use.misses);
+
+    if (_config->FindB("Inapt::Clean", false))
+        clean_archives(cache, final_actions, &use);
 
     if (marked) {
         if (_config->FindB("Inapt::Simulate", false)) {
@@ -419,24 +365,28 @@ static void exec_actions(std::vector<inapt_package *> *final_actions) {
             cache->writeStateFile(NULL);
         }
     }
-}
-
-static void debug_profiles(std::set<std::string> *profiles) {
-    std::string s = "profiles:";
 
-    for (std::set<std::string>::iterator i = profiles->begin(); i != profiles->end(); i++) {
-        s.append(" ");
-        s.append(*i);
-    }
+    if (_error->PendingError())
+        return false;
 
-    debug("%s", s.c_str());
+    /* taken after the install, since the run itself changed the status file */
+    write_state("fingerprint", state_fingerprint(tree, final_actions));
+    write_journal(tree, final_actions);
+    return true;
 }
 
-static void auto_profiles(std::set<std::string> *profiles) {
-    struct utsname uts;
-    if (uname(&uts))
-        fatalpe("uname");
-    profiles->insert(uts.nodename);
+/* spreads the fetches of a fleet prestaging from the same cron entry over the mirrors */
+static void prestage_delay() {
+    int delay = _config->FindI("Inapt::Prestage::Delay", 0);
+    if (delay <= 0)
+        return;
+
+    std::random_device seed;
+    std::uniform_int_distribution<int> jitter (0, delay - 1);
+    int wait = jitter(seed);
+
+    debug("waiting %d seconds before prestaging", wait);
+    sleep(wait);
 }
 
 static void set_option(char *opt) {
@@ -453,17 +403,18 @@ static void set_option(char *opt) {
 int main(int argc, char *argv[]) {
     int opt;
 
-    std::set<std::string> profiles;
+    std::vector<const char *> profile_names;
+    std::vector<const char *> baseline_files;
 
     prog = xstrdup(basename(argv[0]));
-    while ((opt = getopt_long(argc, argv, "?hp:slucedo:", opts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "?hp:slucedo:F:b:fPAL", opts, NULL)) != -1) {
         switch (opt) {
             case '?':
             case 'h':
                 usage();
                 break;
             case 'p':
-                profiles.insert(optarg);
+                profile_names.push_back(optarg);
                 break;
             case 's':
                 _config->Set("Inapt::Simulate", true);
@@ -492,29 +443,99 @@ int main(int argc, char *argv[]) {
             case 'o':
                 set_option(optarg);
                 break;
+            case 'F':
+                _config->Set("Inapt::Fleet", optarg);
+                break;
+            case 'b':
+                baseline_files.push_back(optarg);
+                break;
+            case 'f':
+                _config->Set("Inapt::Force", true);
+                break;
+            case 'P':
+                _config->Set("Inapt::Prestage", true);
+                break;
+            case 'A':
+                _config->Set("Inapt::Agent", true);
+                break;
+            case 'L':
+                _config->Set("Inapt::Lint", true);
+                break;
             default:
                 fatal("error parsing arguments");
         }
     }
 
-    int num_files = argc - optind;
+    std::vector<const char *> spec_files (argv + optind, argv + argc);
 
-    inapt_block context;
+    inapt_tree tree;
     std::vector<inapt_package *> final_actions;
 
-    if (!num_files)
-        parser(NULL, &context);
+    if (spec_files.empty())
+        spec_files.push_back(NULL);
 
-    while (num_files--)
-        parser(argv[optind++], &context);
+    if (_config->FindB("Inapt::Agent", false)) {
+        pkgInitConfig(*_config);
+        pkgInitSystem(*_config, _system);
+        return run_agent(&spec_files, &profile_names);
+    }
+
+    telemetry_init();
+    telemetry_begin("parse");
+    parser(&spec_files, &tree);
+    telemetry_end();
+
+    if (_config->FindB("Inapt::Lint", false))
+        return lint_spec(&tree, &profile_names, stdout);
+
+    if (_config->Exists("Inapt::Fleet")) {
+        inapt_tree baseline;
+
+        if (!baseline_files.empty())
+            parser(&baseline_files, &baseline);
+
+        eval_fleet(_config->Find("Inapt::Fleet").c_str(), &tree,
+                   baseline_files.empty() ? NULL : &baseline, &profile_names);
+        return 0;
+    }
+
+    eval_spec(&tree, &profile_names, &final_actions);
+
+    pkgInitConfig(*_config);
+
+    if (_config->FindB("Inapt::Check", false)) {
+        int status = check_drift(&tree, &final_actions, stdout);
+        _error->DumpErrors();
+        return status;
+    }
+
+    pkgInitSystem(*_config, _system);
+
+    /* before the fingerprint, which covers the lists */
+    if (_config->FindB("Inapt::Update", false) && !update_lists()) {
+        _error->DumpErrors();
+        exit(1);
+    }
+
+    /* the lists are part of the fingerprint, so an upgrade with the same lists finds nothing new */
+    bool fingerprint = !_config->FindB("Inapt::Force", false);
+    if (fingerprint && state_fingerprint(&tree, &final_actions) == read_state("fingerprint")) {
+        debug("fingerprint unchanged since the last run, nothing to do");
+        return 0;
+    }
+
+    /* every directive is marked whenever there is a run; the journal can only show there need not be one */
+    if (fingerprint && journal_covers(&tree, &final_actions)) {
+        debug("all %lu directives applied by the last run, nothing to do", (unsigned long) final_actions.size());
+        if (!_config->FindB("Inapt::Simulate", false) && !_config->FindB("Inapt::Prestage", false))
+            write_state("fingerprint", state_fingerprint(&tree, &final_actions));
+        return 0;
+    }
 
-    auto_profiles(&profiles);
-    eval_profiles(&context, &profiles);
-    debug_profiles(&profiles);
-    eval_block(&context, &profiles, &final_actions);
-    exec_actions(&final_actions);
+    if (_config->FindB("Inapt::Prestage", false))
+        prestage_delay();
 
-    if (_error->PendingError()) {
+    if (!exec_actions(&tree, &final_actions) || _error->PendingError()) {
         _error->DumpErrors();
         exit(1);
     }
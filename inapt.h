@@ -1,39 +1,299 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <set>
 #include <apt-pkg/pkgcache.h>
 
-struct inapt_conditional;
-struct inapt_package;
+class pkgCacheFile;
+
+#define NO_PROFILE (~0U)
+#define NO_BLOCK (~0U)
+#define NO_ALTERNATE (~0U)
+
+/* a half-open range of indices into one of the arrays of an inapt_tree */
+struct inapt_range {
+    unsigned begin, end;
+};
+
+/*
+ * A predicate is a conjunction of clauses, each a disjunction of terms.
+ * Its range indexes the tree's clauses, each of which is a range of the
+ * tree's terms. A term is a profile id shifted left by one with the low
+ * bit set if the profile is negated.
+ */
+struct inapt_predicate {
+    inapt_range clauses;
+};
+
+struct inapt_profile_set {
+    std::vector<unsigned long> bits;
+
+    bool test(unsigned id) const {
+        unsigned word = id / (8 * sizeof(unsigned long));
+        return word < bits.size() && (bits[word] >> (id % (8 * sizeof(unsigned long)))) & 1;
+    }
+
+    void set(unsigned id) {
+        unsigned word = id / (8 * sizeof(unsigned long));
+        if (word >= bits.size())
+            bits.resize(word + 1);
+        bits[word] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    }
+};
 
 struct inapt_action {
     enum action_t { INSTALL, REMOVE } action;
-    std::vector<std::string> predicates;
-    std::vector<inapt_package *> packages;
+    inapt_predicate predicates;
+    inapt_range packages;
 };
 
 struct inapt_package {
     enum inapt_action::action_t action;
-    std::vector<std::string> alternates;
-    std::vector<std::string> predicates;
+    inapt_range alternates;         /* string ids in names */
+    inapt_predicate predicates;
     pkgCache::PkgIterator pkg;
-    const char *filename;
+    unsigned filename;
     int linenum;
 };
 
+/* what a package name stands for, which decides the alternate a directive acts on */
+enum inapt_kind {
+    INAPT_MISSING,                  /* no such package */
+    INAPT_REAL,                     /* a package with a candidate */
+    INAPT_PROVIDED,                 /* a virtual package with a single provider */
+    INAPT_AMBIGUOUS,                /* a virtual package with several */
+    INAPT_UNPROVIDED,               /* a virtual package with none */
+};
+
 struct inapt_profiles {
-    std::vector<std::string> predicates;
-    std::vector<std::string> profiles;
+    inapt_predicate predicates;
+    inapt_range profiles;           /* profile ids in enables */
+    unsigned filename;
+    int linenum;
+};
+
+/*
+ * An include or includedir directive. It is resolved lazily, once its
+ * predicates are known to hold, and then lists the root blocks of the
+ * files it names.
+ */
+struct inapt_include {
+    inapt_predicate predicates;
+    unsigned path;                  /* as written, relative to filename */
+    bool directory;
+    bool resolved;
+    inapt_range files;              /* root blocks in included */
+    unsigned filename;
+    int linenum;
 };
 
 struct inapt_block {
-    std::vector<inapt_action *> actions;
-    std::vector<inapt_conditional *> children;
-    std::vector<inapt_profiles *> profiles;
+    inapt_range actions;
+    inapt_range children;
+    inapt_range profiles;
+    inapt_range includes;
 };
 
 struct inapt_conditional {
-    std::vector<std::string> predicates;
-    struct inapt_block *then_block;
-    struct inapt_block *else_block;
+    inapt_predicate predicates;
+    unsigned then_block;
+    unsigned else_block;            /* NO_BLOCK if there is no else */
+};
+
+/*
+ * Strings interned by intern() are views that must outlive the table;
+ * intern_copy() keeps its own NUL-terminated copy. Profiles also get a
+ * dense numbering of their own so that profile sets stay small.
+ */
+struct inapt_strings {
+    std::vector<std::string_view> strings;
+    std::unordered_map<std::string_view, unsigned> ids;
+    std::deque<std::string> copies;
+    std::vector<bool> copied;
+    std::vector<unsigned> profile_ids;      /* by string id */
+    std::vector<unsigned> profile_names;    /* by profile id */
+
+    unsigned intern(std::string_view s);
+    unsigned intern_copy(std::string_view s);
+    unsigned profile(std::string_view s);
+
+    std::string_view str(unsigned id) const { return strings[id]; }
+    std::string_view profile_name(unsigned profile) const { return strings[profile_names[profile]]; }
+    unsigned profile_count() const { return profile_names.size(); }
+};
+
+/* a file image that interned strings point into, released with the last tree holding it */
+struct inapt_mapping {
+    void *data;
+    size_t size;
+    bool mapped;                    /* else read into memory from malloc() */
+
+    inapt_mapping(void *data, size_t size, bool mapped = true) : data(data), size(size), mapped(mapped) { }
+    inapt_mapping(const inapt_mapping &) = delete;
+    ~inapt_mapping();
+};
+
+/*
+ * The parse tree. Every node lives in one of the arrays below, which own
+ * the whole tree and free it in one step, and nodes refer to each other
+ * by index ranges. roots holds the top-level block of each file named on
+ * the command line; the blocks of included files are only reachable
+ * through their include directives.
+ */
+struct inapt_tree {
+    inapt_strings strings;
+    std::vector<unsigned> terms;
+    std::vector<inapt_range> clauses;
+    std::vector<unsigned> names;
+    std::vector<unsigned> enables;
+    std::vector<inapt_package> packages;
+    std::vector<inapt_action> actions;
+    std::vector<inapt_profiles> profiles;
+    std::vector<inapt_conditional> conditionals;
+    std::vector<inapt_include> includes;
+    std::vector<inapt_block> blocks;
+    std::vector<unsigned> roots;
+    std::vector<unsigned> included;
+    std::unordered_map<std::string, unsigned> loaded;   /* root block by real path */
+    std::vector<std::shared_ptr<inapt_mapping> > mappings;
+
+    /* only for strings interned with intern_copy, such as file names */
+    const char *c_str(unsigned id) const { return strings.strings[id].data(); }
+};
+
+/*
+ * A profiles directive together with the predicates of the conditionals
+ * enclosing it: it applies when every guard holds and no unless does.
+ */
+struct inapt_profile_rule {
+    std::vector<inapt_predicate *> guards;
+    std::vector<inapt_predicate *> unless;
+    inapt_profiles *profiles;
+    unsigned stratum;
 };
 
-void parser(const char *filename, inapt_block *context);
+struct inapt_profile_graph {
+    std::vector<inapt_profile_rule> rules;
+    /* for each profile, the rules whose predicates mention it */
+    std::vector<std::vector<unsigned> > watchers;
+    /* rules grouped so that each group only negates profiles settled by earlier ones */
+    std::vector<std::vector<unsigned> > strata;
+    /* for each stratum, its rules that hold with no profile enabled */
+    std::vector<std::vector<unsigned> > seeds;
+};
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+/* FNV-1a, for cache keys and fingerprints rather than anything adversarial */
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+static inline bool test_profile(unsigned term, inapt_profile_set *profiles) {
+    return profiles->test(term >> 1) != (term & 1);
+}
+
+static inline bool test_anyprofile(const unsigned *term, const unsigned *end, inapt_profile_set *profiles) {
+    for (; term != end; term++)
+        if (test_profile(*term, profiles))
+            return true;
+
+    return false;
+}
+
+static inline bool test_profiles(inapt_tree *tree, inapt_predicate *predicate, inapt_profile_set *profiles) {
+    const unsigned *terms = tree->terms.data();
+    const inapt_range *clauses = tree->clauses.data();
+
+    for (unsigned i = predicate->clauses.begin; i < predicate->clauses.end; i++)
+        if (!test_anyprofile(terms + clauses[i].begin, terms + clauses[i].end, profiles))
+            return false;
+
+    return true;
+}
+
+/* the parser appends the clauses of a predicate together, so their terms are contiguous */
+static inline inapt_range predicate_terms(inapt_tree *tree, inapt_predicate *predicate) {
+    inapt_range terms = { 0, 0 };
+
+    if (predicate->clauses.begin != predicate->clauses.end) {
+        terms.begin = tree->clauses[predicate->clauses.begin].begin;
+        terms.end = tree->clauses[predicate->clauses.end - 1].end;
+    }
+
+    return terms;
+}
+
+void parser(std::vector<const char *> *filenames, inapt_tree *tree);
+void load_includes(inapt_tree *tree, std::vector<unsigned> *pending);
+void load_all_includes(inapt_tree *tree);
+std::string include_path(inapt_tree *tree, inapt_include *include);
+unsigned merge_tree(inapt_tree *to, std::vector<inapt_tree *> *parts);
+
+bool cache_enabled();
+bool load_cached_tree(const char *filename, struct stat *st, inapt_tree *tree);
+void save_cached_tree(const char *filename, struct stat *st, inapt_tree *tree);
+bool save_spec_image(int fd, inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+bool load_spec_image(int fd, inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+
+void eval_block(inapt_tree *tree, unsigned block, inapt_profile_set *profiles, std::vector<bool> *seen,
+                std::vector<inapt_package *> *final_actions);
+void find_includes(inapt_tree *tree, unsigned block, inapt_profile_set *profiles, std::vector<bool> *seen,
+                   std::vector<unsigned> *pending);
+bool sanity_check(inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+unsigned choose_alternate(inapt_tree *tree, inapt_package *package, const unsigned char *kinds);
+void eval_spec(inapt_tree *tree, std::vector<const char *> *profile_names, std::vector<inapt_package *> *final_actions);
+
+void build_profile_graph(inapt_tree *tree, inapt_profile_graph *graph);
+bool test_rule(inapt_tree *tree, inapt_profile_rule *rule, inapt_profile_set *profiles);
+void eval_profiles(inapt_tree *tree, inapt_profile_graph *graph, inapt_profile_set *profiles);
+
+std::string state_fingerprint(inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+std::string plan_fingerprint(pkgCacheFile &cache);
+std::string read_state(const char *name);
+void write_state(const char *name, const std::string &value);
+void clear_state(const char *name);
+void write_journal(inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+bool journal_covers(inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+
+/* the archives one run installed from, and how many of them were already downloaded */
+struct inapt_archive_use {
+    std::vector<std::string> files;
+    std::set<std::string> prefetched;       /* downloaded by this run's prefetch, so not cached */
+    unsigned hits = 0, misses = 0;
+};
+
+std::string archive_name(pkgCache::VerIterator version);
+void clean_archives(pkgCacheFile &cache, std::vector<inapt_package *> *final_actions, inapt_archive_use *use);
+
+struct inapt_prefetch;
+inapt_prefetch *start_prefetch(std::vector<inapt_package *> *final_actions, pkgCacheFile &cache);
+void finish_prefetch(inapt_prefetch *prefetch, pkgCacheFile &cache, inapt_archive_use *use, bool ready);
+
+void telemetry_init();
+void telemetry_begin(const char *phase);
+void telemetry_end();
+void telemetry_count(const char *counter, unsigned long long value);
+
+bool find_conflicts(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache);
+void resolve_packages(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache);
+bool mark_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache, int *marked);
+bool plan_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache);
+bool exec_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions);
+
+int check_drift(inapt_tree *tree, std::vector<inapt_package *> *final_actions, FILE *out);
+int lint_spec(inapt_tree *tree, std::vector<const char *> *profile_names, FILE *out);
+int run_agent(std::vector<const char *> *spec_files, std::vector<const char *> *profile_names);
+
+void eval_fleet(const char *filename, inapt_tree *tree, inapt_tree *baseline, std::vector<const char *> *common);
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Lint checks a spec for every host at once. The profiles a host ends up
+ * with can be any set the profiles directives do not extend, since the
+ * set it starts from is arbitrary and evaluation only adds to it. The
+ * spec thus becomes a formula in clausal form over one variable per
+ * profile, per block (the block is evaluated) and per compound predicate,
+ * and an install and a remove naming the same package clash if the
+ * formula holds with both active. Propagation refutes most such pairs,
+ * and evaluating a guessed host confirms most of the rest; a small DPLL
+ * solver, given a bounded number of conflicts, decides those left, and
+ * the profiles true in its model are those of a host that would hit the
+ * clash.
+ *
+ * Literals are a variable shifted left by one with the low bit set when
+ * negated, as terms are, and the first variables are the profiles, so a
+ * term is its own literal.
+ */
+
+struct lint_solver {
+    std::vector<unsigned> literals;
+    std::vector<inapt_range> clauses;       /* ranges in literals, the first two watched */
+    std::vector<std::vector<unsigned> > watches;    /* by literal, the clauses watching it */
+    std::vector<unsigned> units;
+    std::vector<unsigned char> values;      /* by variable: 0 false, 1 true, 2 unassigned */
+    std::vector<unsigned> trail;
+    std::vector<std::pair<unsigned, bool> > levels;     /* trail position of each decision, and whether flipped */
+    unsigned head = 0;
+    bool contradiction = false;
+
+    unsigned new_var() {
+        values.push_back(2);
+        watches.resize(2 * values.size());
+        return (values.size() - 1) << 1;
+    }
+
+    int value(unsigned lit) const {
+        unsigned char v = values[lit >> 1];
+        return v == 2 ? 2 : v ^ (lit & 1);
+    }
+
+    void assign(unsigned lit) {
+        values[lit >> 1] = !(lit & 1);
+        trail.push_back(lit);
+    }
+
+    void add_clause(std::vector<unsigned> lits);
+    bool propagate();
+    void backtrack(unsigned level);
+    bool assume(std::vector<unsigned> *assumptions);
+    int search(unsigned long limit);
+};
+
+void lint_solver::add_clause(std::vector<unsigned> lits) {
+    std::sort(lits.begin(), lits.end());
+    lits.erase(std::unique(lits.begin(), lits.end()), lits.end());
+    for (unsigned i = 1; i < lits.size(); i++)
+        if (lits[i] == (lits[i - 1] ^ 1))
+            return;
+
+    if (lits.empty()) {
+        contradiction = true;
+    } else if (lits.size() == 1) {
+        units.push_back(lits[0]);
+    } else {
+        inapt_range range = { (unsigned) literals.size(), (unsigned) (literals.size() + lits.size()) };
+        literals.insert(literals.end(), lits.begin(), lits.end());
+        watches[lits[0]].push_back(clauses.size());
+        watches[lits[1]].push_back(clauses.size());
+        clauses.push_back(range);
+    }
+}
+
+/* the two watched literals of a clause are its first two; false on a conflict */
+bool lint_solver::propagate() {
+    while (head < trail.size()) {
+        unsigned falsified = trail[head++] ^ 1;
+        std::vector<unsigned> &ws = watches[falsified];
+        unsigned i, j;
+
+        for (i = j = 0; i < ws.size(); i++) {
+            unsigned c = ws[i];
+            unsigned *lits = literals.data() + clauses[c].begin;
+            unsigned size = clauses[c].end - clauses[c].begin;
+
+            if (lits[0] == falsified)
+                std::swap(lits[0], lits[1]);
+            if (value(lits[0]) == 1) {
+                ws[j++] = c;
+                continue;
+            }
+
+            unsigned k;
+            for (k = 2; k < size && value(lits[k]) == 0; k++)
+                ;
+            if (k < size) {
+                std::swap(lits[1], lits[k]);
+                watches[lits[1]].push_back(c);
+                continue;
+            }
+
+            ws[j++] = c;
+            if (value(lits[0]) == 0) {
+                while (++i < ws.size())
+                    ws[j++] = ws[i];
+                ws.resize(j);
+                return false;
+            }
+            assign(lits[0]);
+        }
+        ws.resize(j);
+    }
+
+    return true;
+}
+
+void lint_solver::backtrack(unsigned level) {
+    unsigned pos = level < levels.size() ? levels[level].first : trail.size();
+
+    while (trail.size() > pos) {
+        values[trail.back() >> 1] = 2;
+        trail.pop_back();
+    }
+    levels.resize(std::min<size_t>(level, levels.size()));
+    head = trail.size();
+}
+
+/* each assumption takes a level of its own, never flipped; false if they contradict the clauses */
+bool lint_solver::assume(std::vector<unsigned> *assumptions) {
+    backtrack(0);
+    if (contradiction)
+        return false;
+
+    if (trail.empty()) {
+        for (std::vector<unsigned>::iterator i = units.begin(); i != units.end(); i++) {
+            if (value(*i) == 0) {
+                contradiction = true;
+                return false;
+            }
+            if (value(*i) == 2)
+                assign(*i);
+        }
+        if (!propagate()) {
+            contradiction = true;
+            return false;
+        }
+    }
+
+    for (std::vector<unsigned>::iterator i = assumptions->begin(); i != assumptions->end(); i++) {
+        if (value(*i) == 0)
+            return false;
+        if (value(*i) == 2) {
+            levels.push_back(std::make_pair((unsigned) trail.size(), true));
+            assign(*i);
+            if (!propagate())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Completes the assignment assume() left: chronological backtracking
+ * without learning, each conflict flipping the latest decision not yet
+ * flipped. Variables are decided false, in order, so models have as few
+ * profiles as the clauses allow. Returns 1 with a model, 0 if there is
+ * none and -1 after limit conflicts without either.
+ */
+int lint_solver::search(unsigned long limit) {
+    unsigned next = 0;
+    for (;;) {
+        while (next < values.size() && values[next] != 2)
+            next++;
+        if (next == values.size())
+            return 1;
+
+        levels.push_back(std::make_pair((unsigned) trail.size(), false));
+        assign(next << 1 | 1);
+
+        while (!propagate()) {
+            if (!limit--)
+                return -1;
+
+            unsigned level = levels.size();
+            while (level > 0 && levels[level - 1].second)
+                level--;
+            if (!level)
+                return 0;
+
+            unsigned lit = trail[levels[level - 1].first];
+            backtrack(level - 1);
+            levels.push_back(std::make_pair((unsigned) trail.size(), true));
+            assign(lit ^ 1);
+            /* everything before the flipped variable was assigned at an earlier level, and still is */
+            next = lit >> 1;
+        }
+    }
+}
+
+struct lint_directive {
+    inapt_package *package;
+    inapt_action *action;
+    unsigned block;
+    unsigned literals[3];       /* its block reached, its action's predicates, its own */
+};
+
+/* one way into a block: its parent is evaluated and the predicate holds, or with negated, does not */
+struct lint_entry {
+    unsigned parent;
+    inapt_predicate *predicate;
+    bool negated;
+};
+
+struct lint_formula {
+    inapt_tree *tree;
+    lint_solver solver;
+    unsigned true_lit;
+    std::unordered_map<const inapt_predicate *, unsigned> predicates;
+    std::vector<std::vector<unsigned> > sites;      /* by block, the includes reaching it */
+    std::vector<std::vector<lint_entry> > entries;  /* by block */
+    std::vector<bool> roots;
+    std::vector<lint_directive> directives;
+};
+
+/* a literal equivalent to the conjunction of two others */
+static unsigned and_lit(lint_formula *formula, unsigned a, unsigned b) {
+    if (a == formula->true_lit)
+        return b;
+    if (b == formula->true_lit)
+        return a;
+
+    unsigned x = formula->solver.new_var();
+    formula->solver.add_clause({ x ^ 1, a });
+    formula->solver.add_clause({ x ^ 1, b });
+    formula->solver.add_clause({ x, a ^ 1, b ^ 1 });
+    return x;
+}
+
+static unsigned clause_lit(lint_formula *formula, inapt_range *clause) {
+    const unsigned *terms = formula->tree->terms.data();
+
+    if (clause->end - clause->begin == 1)
+        return terms[clause->begin];
+
+    unsigned c = formula->solver.new_var();
+    std::vector<unsigned> any (1, c ^ 1);
+    for (unsigned i = clause->begin; i < clause->end; i++) {
+        any.push_back(terms[i]);
+        formula->solver.add_clause({ c, terms[i] ^ 1 });
+    }
+    formula->solver.add_clause(any);
+    return c;
+}
+
+static unsigned predicate_lit(lint_formula *formula, inapt_predicate *predicate) {
+    std::unordered_map<const inapt_predicate *, unsigned>::iterator found = formula->predicates.find(predicate);
+    if (found != formula->predicates.end())
+        return found->second;
+
+    inapt_range range = predicate->clauses;
+    unsigned x;
+    if (range.begin == range.end) {
+        x = formula->true_lit;
+    } else if (range.end - range.begin == 1) {
+        x = clause_lit(formula, &formula->tree->clauses[range.begin]);
+    } else {
+        x = formula->solver.new_var();
+        std::vector<unsigned> all (1, x);
+        for (unsigned i = range.begin; i < range.end; i++) {
+            unsigned c = clause_lit(formula, &formula->tree->clauses[i]);
+            formula->solver.add_clause({ x ^ 1, c });
+            all.push_back(c ^ 1);
+        }
+        formula->solver.add_clause(all);
+    }
+
+    formula->predicates[predicate] = x;
+    return x;
+}
+
+static void encode_block(lint_formula *formula, unsigned block, unsigned reached) {
+    inapt_tree *tree = formula->tree;
+
+    if (block == NO_BLOCK)
+        return;
+
+    inapt_range actions = tree->blocks[block].actions;
+    for (unsigned i = actions.begin; i < actions.end; i++) {
+        unsigned action = predicate_lit(formula, &tree->actions[i].predicates);
+        for (unsigned j = tree->actions[i].packages.begin; j < tree->actions[i].packages.end; j++) {
+            lint_directive directive = { &tree->packages[j], &tree->actions[i], block, { reached, action, 0 } };
+            directive.literals[2] = predicate_lit(formula, &tree->packages[j].predicates);
+            formula->directives.push_back(directive);
+        }
+    }
+
+    /* every set of profiles a host can end up with satisfies each profiles directive */
+    inapt_range profiles = tree->blocks[block].profiles;
+    for (unsigned i = profiles.begin; i < profiles.end; i++) {
+        unsigned guard = predicate_lit(formula, &tree->profiles[i].predicates);
+        for (unsigned j = tree->profiles[i].profiles.begin; j < tree->profiles[i].profiles.end; j++)
+            formula->solver.add_clause({ reached ^ 1, guard ^ 1, tree->enables[j] << 1 });
+    }
+
+    inapt_range children = tree->blocks[block].children;
+    for (unsigned i = children.begin; i < children.end; i++) {
+        inapt_conditional *cond = &tree->conditionals[i];
+        unsigned p = predicate_lit(formula, &cond->predicates);
+        lint_entry then_entry = { block, &cond->predicates, false }, else_entry = { block, &cond->predicates, true };
+
+        if (cond->then_block != NO_BLOCK)
+            formula->entries[cond->then_block].push_back(then_entry);
+        encode_block(formula, cond->then_block, and_lit(formula, reached, p));
+        if (cond->else_block != NO_BLOCK)
+            formula->entries[cond->else_block].push_back(else_entry);
+        encode_block(formula, cond->else_block, and_lit(formula, reached, p ^ 1));
+    }
+
+    inapt_range includes = tree->blocks[block].includes;
+    for (unsigned i = includes.begin; i < includes.end; i++) {
+        inapt_include *include = &tree->includes[i];
+        unsigned site = and_lit(formula, reached, predicate_lit(formula, &include->predicates));
+        lint_entry entry = { block, &include->predicates, false };
+        for (unsigned j = include->files.begin; j < include->files.end; j++) {
+            if (tree->included[j] != NO_BLOCK) {
+                formula->sites[tree->included[j]].push_back(site);
+                formula->entries[tree->included[j]].push_back(entry);
+            }
+        }
+    }
+}
+
+/* an included file is evaluated when any include of it is */
+static void encode_spec(lint_formula *formula) {
+    inapt_tree *tree = formula->tree;
+    std::vector<bool> is_root (tree->blocks.size());
+    std::vector<unsigned> included;
+
+    formula->true_lit = formula->solver.new_var();
+    formula->solver.add_clause({ formula->true_lit });
+    formula->sites.resize(tree->blocks.size());
+    formula->entries.resize(tree->blocks.size());
+    formula->roots.resize(tree->blocks.size());
+
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++) {
+        is_root[*i] = formula->roots[*i] = true;
+        encode_block(formula, *i, formula->true_lit);
+    }
+
+    for (std::vector<unsigned>::iterator i = tree->included.begin(); i != tree->included.end(); i++) {
+        if (*i == NO_BLOCK || is_root[*i])
+            continue;
+        is_root[*i] = true;
+        included.push_back(*i);
+    }
+
+    std::vector<unsigned> reached;
+    for (std::vector<unsigned>::iterator i = included.begin(); i != included.end(); i++) {
+        reached.push_back(formula->solver.new_var());
+        encode_block(formula, *i, reached.back());
+    }
+
+    for (unsigned i = 0; i < included.size(); i++) {
+        std::vector<unsigned> *sites = &formula->sites[included[i]];
+        std::vector<unsigned> any (1, reached[i] ^ 1);
+        for (std::vector<unsigned>::iterator j = sites->begin(); j != sites->end(); j++) {
+            any.push_back(*j);
+            formula->solver.add_clause({ reached[i], *j ^ 1 });
+        }
+        formula->solver.add_clause(any);
+    }
+}
+
+/* what eval_block() would decide, walking up from the block instead of down to it */
+static bool block_reached(lint_formula *formula, unsigned block, inapt_profile_set *profiles) {
+    if (formula->roots[block])
+        return true;
+
+    std::vector<lint_entry> *entries = &formula->entries[block];
+    for (std::vector<lint_entry>::iterator i = entries->begin(); i != entries->end(); i++)
+        if (test_profiles(formula->tree, i->predicate, profiles) != i->negated &&
+            block_reached(formula, i->parent, profiles))
+            return true;
+
+    return false;
+}
+
+static bool directive_active(lint_formula *formula, lint_directive *directive, inapt_profile_set *profiles) {
+    return test_profiles(formula->tree, &directive->package->predicates, profiles) &&
+           test_profiles(formula->tree, &directive->action->predicates, profiles) &&
+           block_reached(formula, directive->block, profiles);
+}
+
+/* enables a profile for each clause of the predicate that still fails, one the solver has not ruled out */
+static void satisfy(lint_formula *formula, inapt_predicate *predicate, inapt_profile_set *profiles) {
+    inapt_tree *tree = formula->tree;
+
+    for (unsigned i = predicate->clauses.begin; i < predicate->clauses.end; i++) {
+        const unsigned *term = tree->terms.data() + tree->clauses[i].begin;
+        const unsigned *end = tree->terms.data() + tree->clauses[i].end;
+        if (test_anyprofile(term, end, profiles))
+            continue;
+
+        for (; term != end; term++) {
+            if (!(*term & 1) && formula->solver.value(*term) != 0) {
+                profiles->set(*term >> 1);
+                break;
+            }
+        }
+    }
+}
+
+/* a guess at the profiles of a host evaluating the directive, along the first way into each block */
+static void guess_profiles(lint_formula *formula, lint_directive *directive, inapt_profile_set *profiles) {
+    satisfy(formula, &directive->package->predicates, profiles);
+    satisfy(formula, &directive->action->predicates, profiles);
+
+    for (unsigned block = directive->block; !formula->roots[block] && !formula->entries[block].empty(); ) {
+        lint_entry *entry = &formula->entries[block][0];
+        if (!entry->negated)
+            satisfy(formula, entry->predicate, profiles);
+        block = entry->parent;
+    }
+}
+
+/* the profiles true in the solver's assignment */
+static void assigned_profiles(lint_formula *formula, inapt_profile_set *profiles) {
+    for (unsigned i = 0; i < formula->tree->strings.profile_count(); i++)
+        if (formula->solver.values[i] == 1)
+            profiles->set(i);
+}
+
+static std::string witness(inapt_tree *tree, inapt_profile_set *set) {
+    std::string profiles;
+
+    for (unsigned i = 0; i < tree->strings.profile_count(); i++) {
+        if (set->test(i)) {
+            profiles.append(profiles.empty() ? "" : " ");
+            profiles.append(tree->strings.profile_name(i));
+        }
+    }
+
+    return profiles.empty() ? "no profiles" : "profiles " + profiles;
+}
+
+static std::string_view shared_name(inapt_tree *tree, inapt_package *a, inapt_package *b) {
+    for (unsigned i = a->alternates.begin; i < a->alternates.end; i++)
+        for (unsigned j = b->alternates.begin; j < b->alternates.end; j++)
+            if (tree->names[i] == tree->names[j])
+                return tree->strings.str(tree->names[i]);
+
+    return tree->strings.str(tree->names[a->alternates.begin]);
+}
+
+static const char *action_name(inapt_package *package) {
+    return package->action == inapt_action::INSTALL ? "install" : "remove";
+}
+
+/*
+ * Reports each install and remove naming a package in common that some
+ * host evaluates together, with the profiles of one such host. Profiles
+ * given on the command line are taken as enabled everywhere. A pair the
+ * search gives up on, after Inapt::Lint::SearchLimit conflicts, is only
+ * counted in a warning; a limit of 0 leaves such pairs to the guess alone.
+ */
+int lint_spec(inapt_tree *tree, std::vector<const char *> *profile_names, FILE *out) {
+    lint_formula formula;
+    inapt_profile_graph graph;
+    unsigned clashes = 0, queries = 0, searches = 0, undecided = 0;
+    unsigned long limit = _config->FindI("Inapt::Lint::SearchLimit", 1000);
+
+    load_all_includes(tree);
+    for (std::vector<const char *>::iterator i = profile_names->begin(); i != profile_names->end(); i++)
+        tree->strings.profile(*i);
+    /* also checks for include loops and profiles enabled through their own absence */
+    build_profile_graph(tree, &graph);
+
+    formula.tree = tree;
+    for (unsigned i = 0; i < tree->strings.profile_count(); i++)
+        formula.solver.new_var();
+    for (std::vector<const char *>::iterator i = profile_names->begin(); i != profile_names->end(); i++)
+        formula.solver.add_clause({ tree->strings.profile(*i) << 1 });
+
+    encode_spec(&formula);
+    debug("lint: %lu variables, %lu clauses, %lu directives", (unsigned long) formula.solver.values.size(),
+          (unsigned long) formula.solver.clauses.size(), (unsigned long) formula.directives.size());
+
+    std::unordered_map<unsigned, std::vector<unsigned> > by_name;
+    for (unsigned i = 0; i < formula.directives.size(); i++) {
+        inapt_package *package = formula.directives[i].package;
+        for (unsigned j = package->alternates.begin; j < package->alternates.end; j++) {
+            std::vector<unsigned> &named = by_name[tree->names[j]];
+            if (named.empty() || named.back() != i)
+                named.push_back(i);
+        }
+    }
+
+    /* two installs or two removes of a package agree, whichever host evaluates them */
+    std::set<std::pair<unsigned, unsigned> > pairs;
+    for (std::unordered_map<unsigned, std::vector<unsigned> >::iterator i = by_name.begin(); i != by_name.end(); i++)
+        for (unsigned a = 0; a < i->second.size(); a++)
+            for (unsigned b = a + 1; b < i->second.size(); b++)
+                if (formula.directives[i->second[a]].package->action != formula.directives[i->second[b]].package->action)
+                    pairs.insert(std::make_pair(i->second[a], i->second[b]));
+
+    for (std::set<std::pair<unsigned, unsigned> >::iterator i = pairs.begin(); i != pairs.end(); i++) {
+        lint_directive *a = &formula.directives[i->first], *b = &formula.directives[i->second];
+        std::vector<unsigned> assumptions (a->literals, a->literals + 3);
+        assumptions.insert(assumptions.end(), b->literals, b->literals + 3);
+
+        /* most pairs that can never meet are refuted by propagation alone */
+        queries++;
+        if (!formula.solver.assume(&assumptions))
+            continue;
+
+        /*
+         * Evaluating from the profiles the pair forces, plus a guess at the
+         * ones it needs, as a host would, is usually enough to find one
+         * where both apply; the search is only needed when it is not.
+         */
+        inapt_profile_set profiles;
+        assigned_profiles(&formula, &profiles);
+        guess_profiles(&formula, a, &profiles);
+        guess_profiles(&formula, b, &profiles);
+        eval_profiles(tree, &graph, &profiles);
+        if (!directive_active(&formula, a, &profiles) || !directive_active(&formula, b, &profiles)) {
+            int found = limit ? formula.solver.search(limit) : -1;
+            searches += limit != 0;
+            if (found < 0)
+                undecided++;
+            if (found <= 0)
+                continue;
+            profiles = inapt_profile_set();
+            assigned_profiles(&formula, &profiles);
+        }
+
+        std::string name (shared_name(tree, a->package, b->package));
+        fprintf(out, "%s:%d: %s %s clashes with %s at %s:%d, with %s\n", tree->c_str(a->package->filename),
+                a->package->linenum, action_name(a->package), name.c_str(), action_name(b->package),
+                tree->c_str(b->package->filename), b->package->linenum, witness(tree, &profiles).c_str());
+        clashes++;
+    }
+
+    if (undecided)
+        warn("%u install and remove pairs were left undecided; raise Inapt::Lint::SearchLimit to decide them",
+             undecided);
+    debug("lint: %u clashes in %u pairs, %u searched", clashes, queries, searches);
+    return clashes ? 3 : 0;
+}
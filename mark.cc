@@ -0,0 +1,202 @@
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/* what one package name resolves to, whichever directive names it */
+struct inapt_resolved {
+    enum inapt_kind kind;
+    pkgCache::PkgIterator pkg;
+    pkgCache::PkgIterator provider;     /* the single provider when PROVIDED */
+};
+
+static void resolve_name(inapt_tree *tree, unsigned name, pkgCacheFile &cache, inapt_resolved *resolved) {
+    pkgCache::PkgIterator tmp = cache->FindPkg(std::string(tree->strings.str(name)));
+
+    resolved->pkg = tmp;
+    if (tmp.end())
+        resolved->kind = INAPT_MISSING;
+    else if (cache[tmp].CandidateVer)
+        resolved->kind = INAPT_REAL;
+    else if (!tmp->ProvidesList)
+        resolved->kind = INAPT_UNPROVIDED;
+    else if (tmp.ProvidesList()->NextProvides)
+        resolved->kind = INAPT_AMBIGUOUS;
+    else {
+        resolved->kind = INAPT_PROVIDED;
+        resolved->provider = tmp.ProvidesList().OwnerPkg();
+    }
+}
+
+/* resolves every name mentioned by the final actions once, indexed by string id */
+static void resolve_names(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache,
+                          std::vector<inapt_resolved> *resolved) {
+    std::vector<bool> wanted (tree->strings.strings.size());
+    unsigned names = 0;
+
+    resolved->resize(tree->strings.strings.size());
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        for (unsigned j = (*i)->alternates.begin; j < (*i)->alternates.end; j++) {
+            unsigned name = tree->names[j];
+            if (!wanted[name]) {
+                wanted[name] = true;
+                resolve_name(tree, name, cache, &(*resolved)[name]);
+                names++;
+            }
+        }
+    }
+
+    debug("resolved %u names for %lu directives", names, (unsigned long) final_actions->size());
+}
+
+static pkgCache::PkgIterator eval_pkg(inapt_tree *tree, inapt_package *package, std::vector<inapt_resolved> *resolved,
+                                      std::vector<unsigned char> *kinds) {
+    unsigned i = choose_alternate(tree, package, kinds->data());
+    if (i == NO_ALTERNATE)
+        return pkgCache::PkgIterator();
+
+    inapt_resolved *r = &(*resolved)[tree->names[i]];
+    if (r->kind != INAPT_PROVIDED)
+        return r->pkg;
+
+    debug("selecting %s instead of %s", r->provider.Name(), r->pkg.Name());
+    return r->provider;
+}
+
+/*
+ * Marks the packages the directives install in one batch. Each is marked
+ * alone first, so that directives naming each other's dependencies count
+ * as satisfying them, and the dependencies of those the batch leaves
+ * broken are walked after. Recommends are walked last, and only for the
+ * packages still missing some; with APT::Install-Recommends on that is
+ * most of them, so this does about as many walks as marking one by one.
+ * What it changes is the or-groups: marking one by one pulls in the first
+ * alternative even when a later directive installs another.
+ */
+static void mark_batch(pkgCacheFile &cache, std::vector<pkgCache::PkgIterator> *installs) {
+    std::vector<bool> walked (installs->size());
+    unsigned depends = 0, recommends = 0;
+
+    for (std::vector<pkgCache::PkgIterator>::iterator i = installs->begin(); i != installs->end(); i++)
+        cache->MarkInstall(*i, false);
+
+    for (unsigned i = 0; i < installs->size(); i++) {
+        if (cache[(*installs)[i]].InstBroken()) {
+            cache->MarkInstall((*installs)[i], true);
+            walked[i] = true;
+            depends++;
+        }
+    }
+
+    for (unsigned i = 0; i < installs->size(); i++) {
+        if (!walked[i] && cache[(*installs)[i]].InstPolicyBroken()) {
+            cache->MarkInstall((*installs)[i], true);
+            recommends++;
+        }
+    }
+
+    debug("marked %lu packages, %u walked for their dependencies and %u for their recommends",
+          (unsigned long) installs->size(), depends, recommends);
+}
+
+/* sets the package each directive acts on, left at the end where there is none, and queues the diagnostics */
+void resolve_packages(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
+    std::vector<inapt_resolved> resolved;
+
+    telemetry_begin("resolve_names");
+    resolve_names(tree, final_actions, cache, &resolved);
+    telemetry_end();
+
+    std::vector<unsigned char> kinds (resolved.size(), INAPT_MISSING);
+    for (unsigned i = 0; i < resolved.size(); i++)
+        kinds[i] = resolved[i].kind;
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++)
+        (*i)->pkg = eval_pkg(tree, *i, &resolved, &kinds);
+}
+
+/* resolves and marks the directives' packages, counting those turned manual in marked; warnings stay queued */
+bool mark_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions, pkgCacheFile &cache, int *marked) {
+    bool purge = _config->FindB("Inapt::Purge", false);
+    bool upgrade = _config->FindB("Inapt::Upgrade", false);
+
+    resolve_packages(tree, final_actions, cache);
+    if (_error->PendingError())
+        return false;
+
+    /* a request proven unsatisfiable fails here, rather than after the resolver gives up */
+    telemetry_begin("conflicts");
+    bool consistent = find_conflicts(tree, final_actions, cache);
+    telemetry_end();
+    if (!consistent)
+        return false;
+
+    telemetry_begin("mark");
+
+    // preliminary loop (auto-installs, includes recommends - could do this manually)
+    std::vector<pkgCache::PkgIterator> installs;
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i < final_actions->end(); i++) {
+        pkgCache::PkgIterator k = (*i)->pkg;
+	if (k.end())
+		continue;
+        switch ((*i)->action) {
+            case inapt_action::INSTALL:
+                if (!k.CurrentVer() || cache[k].Delete()) {
+                    debug("install %s %s:%d", (*i)->pkg.Name(), tree->c_str((*i)->filename), (*i)->linenum);
+                    installs.push_back(k);
+                } else if (upgrade && cache[k].Upgradable() && k->SelectedState != pkgCache::State::Hold) {
+                    /* pulls in only the dependency upgrades the new version requires */
+                    debug("upgrade %s %s:%d", (*i)->pkg.Name(), tree->c_str((*i)->filename), (*i)->linenum);
+                    installs.push_back(k);
+                }
+                break;
+            case inapt_action::REMOVE:
+                break;
+            default:
+                fatal("uninitialized action");
+        }
+    }
+
+    if (_config->FindB("Inapt::Mark::Batch", true)) {
+        mark_batch(cache, &installs);
+    } else {
+        for (std::vector<pkgCache::PkgIterator>::iterator i = installs.begin(); i != installs.end(); i++)
+            cache->MarkInstall(*i, true);
+    }
+
+    // secondary loop (removes package and reinstalls auto-removed packages)
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i < final_actions->end(); i++) {
+        pkgCache::PkgIterator k = (*i)->pkg;
+	if (k.end())
+		continue;
+        switch ((*i)->action) {
+            case inapt_action::INSTALL:
+                if ((!k.CurrentVer() && !cache[k].Install()) || cache[k].Delete()) {
+                    debug("force install %s %s:%d", (*i)->pkg.Name(), tree->c_str((*i)->filename), (*i)->linenum);
+                    cache->MarkInstall(k, false);
+                }
+                if (cache[k].Flags & pkgCache::Flag::Auto) {
+                    debug("marking %s as manually installed", (*i)->pkg.Name());
+                    cache->MarkAuto(k, false);
+                    (*marked)++;
+                }
+                break;
+            case inapt_action::REMOVE:
+                if ((k.CurrentVer() && !cache[k].Delete()) || cache[k].Install())
+                    debug("remove %s %s:%d", (*i)->pkg.Name(), tree->c_str((*i)->filename), (*i)->linenum);
+
+                /* always mark so purge works */
+                cache->MarkDelete(k, purge);
+                break;
+            default:
+                fatal("uninitialized action");
+        }
+    }
+
+    telemetry_end();
+    return !_error->PendingError();
+}
@@ -1,11 +1,23 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include <apt-pkg/configuration.h>
+
 #include "inapt.h"
 #include "util.h"
 
@@ -20,39 +32,48 @@ using namespace std;
     action strstart { ts = p; }
 
     action add_alternate {
-        std::string tmp (ts, p - ts); ts = 0;
-        alternates.push_back(tmp);
+        tree->names.push_back(tree->strings.intern(std::string_view(ts, p - ts))); ts = 0;
     }
 
     action add_package {
-        inapt_package *tmp_package = new inapt_package;
-        tmp_package->alternates.swap(alternates);
-        tmp_package->action = tmp_action->action;
-        tmp_package->linenum = curline - (*p == '\n');
-        tmp_package->filename = curfile;
-        tmp_package->predicates.swap(predicates);
-        tmp_action->packages.push_back(tmp_package);
+        inapt_action *action = &scratch[depth].actions.back();
+        inapt_package package;
+        package.action = action->action;
+        package.alternates = take_range(&alternates, tree->names.size());
+        package.predicates = take_predicate();
+        package.linenum = curline - (*p == '\n');
+        package.filename = curfile;
+        tree->packages.push_back(package);
+        action->packages.end = tree->packages.size();
     }
 
     action start_install {
-        tmp_action = new inapt_action;
-        tmp_action->action = inapt_action::INSTALL;
-        tmp_action->predicates.swap(predicates);
-        block_stack.back()->actions.push_back(tmp_action);
+        start_action(inapt_action::INSTALL);
     }
 
     action start_remove {
-        tmp_action = new inapt_action;
-        tmp_action->action = inapt_action::REMOVE;
-        tmp_action->predicates.swap(predicates);
-        block_stack.back()->actions.push_back(tmp_action);
+        start_action(inapt_action::REMOVE);
     }
 
     action add_profiles {
-        inapt_profiles *tmp_profiles = new inapt_profiles;
-        tmp_profiles->profiles.swap(profiles);
-        tmp_profiles->predicates.swap(predicates);
-        block_stack.back()->profiles.push_back(tmp_profiles);
+        inapt_profiles tmp_profiles;
+        tmp_profiles.profiles = take_range(&profiles, tree->enables.size());
+        tmp_profiles.predicates = take_predicate();
+        tmp_profiles.filename = curfile;
+        tmp_profiles.linenum = curline;
+        scratch[depth].profiles.push_back(tmp_profiles);
+    }
+
+    action include_path {
+        include_path = tree->strings.intern_copy(std::string_view(ts, p - ts)); ts = 0;
+    }
+
+    action add_include {
+        add_include(false);
+    }
+
+    action add_includedir {
+        add_include(true);
     }
 
     action newline {
@@ -61,50 +82,50 @@ using namespace std;
 
     action start_block {
         if (top < MAXDEPTH) {
-            inapt_block *tmp_block = new inapt_block;
-            block_stack.push_back(tmp_block);
+            open_block();
             fcall main;
         } else {
-            fatal("%s: %d: Syntax Error: Nesting Too Deep at '{'", curfile, curline);
+            syntax_error("%s: %d: Syntax Error: Nesting Too Deep at '{'", tree->c_str(curfile), curline);
+            fbreak;
         }
     }
 
     action end_block {
         if (top) {
+            closed.push_back(close_block());
             fret;
         } else {
-            fatal("%s: %d: Syntax Error: Unexpected '}'", curfile, curline);
+            syntax_error("%s: %d: Syntax Error: Unexpected '}'", tree->c_str(curfile), curline);
+            fbreak;
         }
     }
 
     action start_conditional {
-        inapt_conditional *cond = new inapt_conditional;
-        cond->predicates.swap(predicates);
-        conditional_stack.push_back(cond);
+        conditional_stack.push_back(take_predicate());
     }
 
     action full_conditional {
-        inapt_conditional *cond = conditional_stack.back(); conditional_stack.pop_back();
-        cond->else_block = block_stack.back(); block_stack.pop_back();
-        cond->then_block = block_stack.back(); block_stack.pop_back();
-        block_stack.back()->children.push_back(cond);
+        inapt_conditional cond;
+        cond.predicates = conditional_stack.back(); conditional_stack.pop_back();
+        cond.else_block = closed.back(); closed.pop_back();
+        cond.then_block = closed.back(); closed.pop_back();
+        scratch[depth].children.push_back(cond);
     }
 
     action half_conditional {
-        inapt_conditional *cond = conditional_stack.back(); conditional_stack.pop_back();
-        cond->else_block = NULL;
-        cond->then_block = block_stack.back(); block_stack.pop_back();
-        block_stack.back()->children.push_back(cond);
+        inapt_conditional cond;
+        cond.predicates = conditional_stack.back(); conditional_stack.pop_back();
+        cond.else_block = NO_BLOCK;
+        cond.then_block = closed.back(); closed.pop_back();
+        scratch[depth].children.push_back(cond);
     }
 
     action predicate {
-        std::string tmp (ts, p - ts); ts = 0;
-        predicates.push_back(tmp);
+        add_clause(ts, p); ts = 0;
     }
 
     action profile {
-        std::string tmp (ts, p - ts); ts = 0;
-        profiles.push_back(tmp);
+        tree->enables.push_back(tree->strings.profile(std::string_view(ts, p - ts))); ts = 0;
     }
 
     newline = '\n' @newline;
@@ -116,20 +137,99 @@ using namespace std;
     package_alternates = package_name >strstart %add_alternate ('/' package_name >strstart %add_alternate)*;
     package_list = ((whitespace+ predicate* package_alternates)+ %add_package whitespace*);
     profile_list = (whitespace+ profile >strstart %profile)* whitespace*;
+    path = (any - space - [;#{}])+;
     cmd_install = ('install' @start_install package_list ';');
     cmd_remove = ('remove' @start_remove package_list ';');
     cmd_profiles = ('profiles' profile_list ';' @add_profiles);
+    cmd_include = ('include' whitespace+ path >strstart %include_path whitespace* ';' @add_include);
+    cmd_includedir = ('includedir' whitespace+ path >strstart %include_path whitespace* ';' @add_includedir);
     end_block = '}' @end_block;
     cmd_if = 'if' whitespace+ predicate+ '{' @start_conditional @start_block whitespace*
              ('else' whitespace* '{' @start_block whitespace* ';' @full_conditional | ';' @half_conditional);
-    cmd = whitespace* (predicate* (cmd_install | cmd_remove | cmd_profiles) | cmd_if);
+    cmd = whitespace* (predicate* (cmd_install | cmd_remove | cmd_profiles | cmd_include | cmd_includedir) | cmd_if);
     cmd_list = cmd* whitespace* end_block?;
     main := cmd_list;
 }%%
 
 %% write data;
 
-static void badsyntax(const char *filename, int lineno, char badchar, const char *message) {
+/* the children of a block that is still being parsed */
+struct inapt_scratch {
+    std::vector<inapt_action> actions;
+    std::vector<inapt_conditional> children;
+    std::vector<inapt_profiles> profiles;
+    std::vector<inapt_include> includes;
+};
+
+/*
+ * Parser state for one input. Inputs are parsed in place: package names in
+ * the tree point into the input, which must outlive the tree. Errors are
+ * kept rather than reported, since inputs are parsed on several threads.
+ *
+ * The children of each open block are collected in scratch and only
+ * appended to the tree when the block closes, so that every block's
+ * children end up contiguous. Predicates, alternates and profile lists
+ * are appended to the tree as they are scanned; the pending ones are
+ * those from the recorded start to the end of the array.
+ */
+struct inapt_parser {
+    int cs, top;
+    int stack[MAXDEPTH];
+    int curline;
+    unsigned curfile;
+    const char *ts;
+    inapt_tree *tree;
+
+    int depth;
+    std::vector<inapt_scratch> scratch;
+    std::vector<unsigned> closed;
+    std::vector<inapt_predicate> conditional_stack;
+    unsigned alternates, predicates, profiles;
+    unsigned include_path;
+    std::string error;
+
+    inapt_parser(unsigned filename, int linenum, inapt_tree *tree);
+    void parse(const char *p, const char *pe);
+    PRINTF_LIKE(1) void syntax_error(const char *fmt, ...);
+    void badsyntax(char badchar, const char *message);
+
+    inapt_range take_range(unsigned *start, unsigned end);
+    inapt_predicate take_predicate();
+    void add_clause(const char *s, const char *e);
+    void start_action(inapt_action::action_t action);
+    void add_include(bool directory);
+    void open_block();
+    unsigned close_block();
+};
+
+inapt_parser::inapt_parser(unsigned filename, int linenum, inapt_tree *tree) : tree(tree) {
+    curline = linenum;
+    curfile = filename;
+    ts = 0;
+    depth = -1;
+    alternates = tree->names.size();
+    predicates = tree->clauses.size();
+    profiles = tree->enables.size();
+    open_block();
+
+    %% write init;
+}
+
+/* only the first error is kept */
+void inapt_parser::syntax_error(const char *fmt, ...) {
+    va_list args;
+    char buf[1024];
+
+    if (!error.empty())
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    error = buf;
+}
+
+void inapt_parser::badsyntax(char badchar, const char *message) {
     if (!message) {
         if (badchar == '\n')
             message = "Unexpected newline";
@@ -140,77 +240,446 @@ static void badsyntax(const char *filename, int lineno, char badchar, const char
     }
 
     if (isprint(badchar) && !isspace(badchar))
-        fatal("%s: %d: %s at '%c'", filename, lineno, message, badchar);
+        syntax_error("%s: %d: %s at '%c'", tree->c_str(curfile), curline, message, badchar);
     else
-        fatal("%s: %d: %s", filename, lineno, message);
+        syntax_error("%s: %d: %s", tree->c_str(curfile), curline, message);
 }
 
-void parser(const char *filename, inapt_block *top_block)
-{
-    static char buf[BUFSIZE];
-    int fd;
-    int cs, have = 0;
-    int done = 0;
-    int curline = 1;
-    char *ts = 0;
-
-    std::vector<inapt_block *> block_stack;
-    std::vector<inapt_conditional *> conditional_stack;
-    std::vector<std::string> alternates;
-    std::vector<std::string> predicates;
-    std::vector<std::string> profiles;
-    block_stack.push_back(top_block);
-    inapt_action *tmp_action = NULL;
+inapt_range inapt_parser::take_range(unsigned *start, unsigned end) {
+    inapt_range range = { *start, end };
+    *start = end;
+    return range;
+}
 
-    int stack[MAXDEPTH];
-    int top = 0;
+inapt_predicate inapt_parser::take_predicate() {
+    inapt_predicate predicate;
+    predicate.clauses = take_range(&predicates, tree->clauses.size());
+    return predicate;
+}
+
+void inapt_parser::add_clause(const char *s, const char *e) {
+    inapt_range clause;
+    clause.begin = tree->terms.size();
+
+    while (s < e) {
+        bool negated = *s == '!';
+        if (negated)
+            s++;
+
+        const char *end = (const char *) memchr(s, '/', e - s);
+        if (!end)
+            end = e;
+
+        tree->terms.push_back(tree->strings.profile(std::string_view(s, end - s)) << 1 | negated);
+        s = end + 1;
+    }
+
+    clause.end = tree->terms.size();
+    tree->clauses.push_back(clause);
+}
+
+void inapt_parser::start_action(inapt_action::action_t type) {
+    inapt_action action;
+    action.action = type;
+    action.predicates = take_predicate();
+    action.packages.begin = action.packages.end = tree->packages.size();
+    scratch[depth].actions.push_back(action);
+}
+
+void inapt_parser::add_include(bool directory) {
+    inapt_include include;
+    include.predicates = take_predicate();
+    include.path = include_path;
+    include.directory = directory;
+    include.resolved = false;
+    include.files.begin = include.files.end = 0;
+    include.filename = curfile;
+    include.linenum = curline;
+    scratch[depth].includes.push_back(include);
+}
+
+void inapt_parser::open_block() {
+    depth++;
+    if (scratch.size() <= (unsigned) depth)
+        scratch.resize(depth + 1);
+}
+
+template <class T> static inapt_range append(std::vector<T> *to, std::vector<T> *from) {
+    inapt_range range;
+    range.begin = to->size();
+    to->insert(to->end(), from->begin(), from->end());
+    range.end = to->size();
+    from->clear();
+    return range;
+}
+
+unsigned inapt_parser::close_block() {
+    inapt_block block;
+    block.actions = append(&tree->actions, &scratch[depth].actions);
+    block.children = append(&tree->conditionals, &scratch[depth].children);
+    block.profiles = append(&tree->profiles, &scratch[depth].profiles);
+    block.includes = append(&tree->includes, &scratch[depth].includes);
+    tree->blocks.push_back(block);
+    depth--;
+    return tree->blocks.size() - 1;
+}
+
+void inapt_parser::parse(const char *p, const char *pe) {
+    %% write exec;
+
+    if (!error.empty())
+        return;
+
+    if (cs == inapt_error)
+        return badsyntax(*p, NULL);
+
+    if (cs < inapt_first_final)
+        return badsyntax(0, "Unexpected EOF (forgot semicolon?)");
+
+    if (top)
+        return badsyntax(0, "Unclosed block at EOF");
+
+    tree->roots.push_back(close_block());
+}
+
+/* pipes and terminals cannot be mapped, so read them into a growing buffer; NULL with errno set on failure */
+static const char *read_input(int fd, size_t *size) {
+    size_t alloc = BUFSIZE;
+    char *buf = (char *) xmalloc(alloc);
+    ssize_t len;
+
+    *size = 0;
+    while ((len = read(fd, buf + *size, alloc - *size)) != 0) {
+        if (len < 0) {
+            int saved = errno;
+            free(buf);
+            errno = saved;
+            return NULL;
+        }
+        *size += len;
+        if (*size == alloc)
+            buf = (char *) xrealloc(buf, alloc *= 2);
+    }
+
+    return buf;
+}
+
+/* held by the tree the input is merged into, since its strings point into it */
+static std::shared_ptr<inapt_mapping> map_input(int fd, struct stat *st) {
+    size_t size;
+
+    if (!S_ISREG(st->st_mode)) {
+        const char *data = read_input(fd, &size);
+        if (!data)
+            return NULL;
+        return std::make_shared<inapt_mapping>((void *) data, size, false);
+    }
 
-    const char *curfile = filename;
+    size = st->st_size;
+    if (!size)
+        return std::make_shared<inapt_mapping>(xmalloc(1), 0, false);
 
-    if (!filename || !strcmp(filename, "-")) {
-        curfile = "stdin";
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    return std::make_shared<inapt_mapping>(data, size);
+}
+
+/* one input file, either loaded from the cache or cut into chunks */
+struct inapt_input {
+    const char *filename;
+    struct stat st;
+    bool cacheable, cached;
+    const char *failed;         /* the step that failed, with its errno in failed_errno */
+    int failed_errno;
+    std::shared_ptr<inapt_mapping> mapping;
+    inapt_tree tree;
+    unsigned first_chunk, end_chunk;
+};
+
+/* one piece of one input, parsed into a tree of its own */
+struct inapt_chunk {
+    const char *filename;
+    const char *data, *end;
+    int linenum;
+    inapt_tree tree;
+    std::string error;
+};
+
+static void add_chunk(const char *filename, const char *data, const char *end, int linenum,
+                      std::vector<inapt_chunk> *chunks) {
+    chunks->resize(chunks->size() + 1);
+    chunks->back().filename = filename;
+    chunks->back().data = data;
+    chunks->back().end = end;
+    chunks->back().linenum = linenum;
+}
+
+/*
+ * Large inputs are cut after a ';' outside any block, where the scanner is
+ * back in its start state, so that each piece parses on its own. Braces
+ * never appear in names and comments are skipped, so depth is exact for
+ * valid input; an unbalanced '}' stops the cutting and leaves the error
+ * to the parser.
+ */
+static void split_input(const char *filename, const char *data, size_t size, size_t chunk_size,
+                        std::vector<inapt_chunk> *chunks) {
+    const char *p = data, *start = data, *end = data + size;
+    int depth = 0, line = 1, start_line = 1;
+
+    while (p < end) {
+        char c = *p++;
+
+        if (c == '\n') {
+            line++;
+        } else if (c == '#') {
+            const char *eol = (const char *) memchr(p, '\n', end - p);
+            p = eol ? eol : end;
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (!depth--)
+                break;
+        } else if (c == ';' && !depth && (size_t) (p - start) >= chunk_size) {
+            add_chunk(filename, start, p, start_line, chunks);
+            start = p;
+            start_line = line;
+        }
+    }
+
+    add_chunk(filename, start, end, start_line, chunks);
+}
+
+static void parse_chunk(inapt_chunk *chunk) {
+    inapt_parser state (chunk->tree.strings.intern_copy(chunk->filename), chunk->linenum, &chunk->tree);
+    state.parse(chunk->data, chunk->end);
+    chunk->error = state.error;
+}
+
+/* opens one input and loads or splits it; on failure records the step and stops */
+static bool open_input(inapt_input *input, size_t chunk_size, std::vector<inapt_chunk> *chunks) {
+    int fd;
+
+    input->first_chunk = input->end_chunk = chunks->size();
+    input->failed = NULL;
+
+    if (!input->filename || !strcmp(input->filename, "-")) {
+        input->filename = "stdin";
         fd = 0;
     } else {
-        fd = open(filename, O_RDONLY);
-        if (fd < 0)
-            fatalpe("open: %s", filename);
+        fd = open(input->filename, O_RDONLY);
+        if (fd < 0) {
+            input->failed = "open";
+            input->failed_errno = errno;
+            return false;
+        }
     }
 
-    %% write init;
+    if (fstat(fd, &input->st)) {
+        input->failed = "stat";
+    } else {
+        input->cacheable = fd && S_ISREG(input->st.st_mode) && cache_enabled();
+        input->cached = input->cacheable && load_cached_tree(input->filename, &input->st, &input->tree);
+
+        if (!input->cached) {
+            input->mapping = map_input(fd, &input->st);
+            if (input->mapping)
+                split_input(input->filename, (const char *) input->mapping->data, input->mapping->size, chunk_size,
+                            chunks);
+            else
+                input->failed = S_ISREG(input->st.st_mode) ? "mmap" : "Unable to read spec";
+        }
+        input->end_chunk = chunks->size();
+    }
+    input->failed_errno = errno;
+
+    if (fd)
+        close(fd);
 
-    while (!done) {
-        char *p = buf + have, *pe;
-        int len, space = BUFSIZE - have;
+    return !input->failed;
+}
+
+/*
+ * Parses the given files, or stdin for a NULL or "-" entry, into tree and
+ * appends the root block of each to roots. Inputs are opened in order and
+ * loaded from the cache where it is still current. The rest are cut into
+ * chunks, and the chunks scanned in parallel into separate trees.
+ * Everything is merged back in order, so the tree and the first error
+ * reported do not depend on the number of threads or on what was cached.
+ * An input that cannot be opened or read stops the opening, but is only
+ * reported once the inputs before it have parsed cleanly.
+ */
+static void parse_inputs(std::vector<const char *> *filenames, inapt_tree *tree, std::vector<unsigned> *roots)
+{
+    std::vector<inapt_input> inputs (filenames->size());
+    std::vector<inapt_chunk> chunks;
+    size_t chunk_size = _config->FindI("Inapt::Parse::ChunkSize", 1 << 20);
+    unsigned opened = 0;
 
-        if (!space)
-            badsyntax(curfile, curline, 0, "Overlength token");
+    while (opened < inputs.size()) {
+        inapt_input *input = &inputs[opened++];
 
-        len = read(fd, p, space);
-        if (len < 0)
-            fatalpe("Unable to read spec");
-        pe = p + len;
+        input->filename = (*filenames)[opened - 1];
+        if (!open_input(input, chunk_size, &chunks))
+            break;
+    }
 
-        if (!len) {
-            done = 1;
+    parallel_for(chunks.size(), _config->FindI("Inapt::Parse::Threads", std::thread::hardware_concurrency()),
+                 [&](unsigned c) { parse_chunk(&chunks[c]); });
+
+    for (unsigned f = 0; f < opened; f++) {
+        for (unsigned c = inputs[f].first_chunk; c < inputs[f].end_chunk; c++)
+            if (!chunks[c].error.empty())
+                fatal("%s", chunks[c].error.c_str());
+
+        if (inputs[f].failed) {
+            errno = inputs[f].failed_errno;
+            fatalpe("%s: %s", inputs[f].failed, inputs[f].filename);
         }
+    }
 
-        %% write exec;
+    for (std::vector<inapt_input>::iterator i = inputs.begin(); i != inputs.end(); i++) {
+        std::vector<inapt_tree *> parts;
 
-        if (cs == inapt_error)
-            badsyntax(curfile, curline, *p, NULL);
+        for (unsigned c = i->first_chunk; c < i->end_chunk; c++)
+            parts.push_back(&chunks[c].tree);
 
-        have = 0;
+        if (i->cacheable && !i->cached) {
+            i->tree.roots.push_back(merge_tree(&i->tree, &parts));
+            save_cached_tree(i->filename, &i->st, &i->tree);
+        }
+
+        if (i->cacheable) {
+            parts.clear();
+            parts.push_back(&i->tree);
+        }
 
-        if (ts) {
-            have = pe - ts;
-            memmove(buf, ts, have);
-            ts = buf;
+        unsigned root = merge_tree(tree, &parts);
+        roots->push_back(root);
+        if (i->mapping)
+            tree->mappings.push_back(i->mapping);
+
+        if (S_ISREG(i->st.st_mode)) {
+            char *real = realpath(i->filename, NULL);
+            if (real) {
+                tree->loaded[real] = root;
+                free(real);
+            }
         }
     }
 
-    if (cs < inapt_first_final)
-        badsyntax(curfile, curline, 0, "Unexpected EOF (forgot semicolon?)");
+    debug("parsed %lu files in %lu chunks", (unsigned long) filenames->size(), (unsigned long) chunks.size());
+}
 
-    if (top)
-        badsyntax(curfile, curline, 0, "Unclosed block at EOF");
+void parser(std::vector<const char *> *filenames, inapt_tree *tree)
+{
+    parse_inputs(filenames, tree, &tree->roots);
+}
+
+/* relative paths are taken from the directory of the including file */
+std::string include_path(inapt_tree *tree, inapt_include *include) {
+    std::string path (tree->strings.str(include->path));
+
+    if (path[0] == '/')
+        return path;
+
+    std::string dir (tree->strings.str(include->filename));
+    std::string::size_type slash = dir.rfind('/');
+    if (slash == std::string::npos)
+        return path;
+
+    return dir.substr(0, slash + 1) + path;
+}
+
+/* like run-parts, skip hidden files and editor backups */
+static void list_includedir(const char *filename, int linenum, std::string dir, std::vector<std::string> *paths) {
+    std::vector<std::string> names;
+    struct dirent *de;
+    struct stat st;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        fatalpe("%s: %d: opendir: %s", filename, linenum, dir.c_str());
+
+    while ((de = readdir(d))) {
+        size_t len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || de->d_name[len - 1] == '~')
+            continue;
+        names.push_back(de->d_name);
+    }
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+    for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); i++) {
+        std::string path = dir + "/" + *i;
+        if (!stat(path.c_str(), &st) && S_ISREG(st.st_mode))
+            paths->push_back(path);
+    }
+}
+
+/*
+ * Resolves the pending include directives. Files that were already loaded
+ * are reused; the rest are parsed together, in parallel, and become root
+ * blocks reachable only through their includes.
+ */
+void load_includes(inapt_tree *tree, std::vector<unsigned> *pending) {
+    std::vector<std::vector<std::string> > reals (pending->size());
+    std::vector<std::string> paths;
+    std::vector<const char *> filenames;
+    std::vector<unsigned> roots;
+
+    for (unsigned i = 0; i < pending->size(); i++) {
+        inapt_include *include = &tree->includes[(*pending)[i]];
+        const char *filename = tree->c_str(include->filename);
+        std::string path = include_path(tree, include);
+        std::vector<std::string> files;
+
+        if (include->directory)
+            list_includedir(filename, include->linenum, path, &files);
+        else
+            files.push_back(path);
+
+        for (std::vector<std::string>::iterator j = files.begin(); j != files.end(); j++) {
+            char *real = realpath(j->c_str(), NULL);
+            if (!real)
+                fatalpe("%s: %d: include: %s", filename, include->linenum, j->c_str());
+            reals[i].push_back(real);
+
+            if (!tree->loaded.count(real)) {
+                tree->loaded[real] = NO_BLOCK;
+                paths.push_back(*j);
+            }
+            free(real);
+        }
+    }
+
+    for (std::vector<std::string>::iterator i = paths.begin(); i != paths.end(); i++)
+        filenames.push_back(i->c_str());
+    parse_inputs(&filenames, tree, &roots);
+
+    for (unsigned i = 0; i < pending->size(); i++) {
+        inapt_include *include = &tree->includes[(*pending)[i]];
+        include->files.begin = tree->included.size();
+        for (std::vector<std::string>::iterator j = reals[i].begin(); j != reals[i].end(); j++)
+            tree->included.push_back(tree->loaded[*j]);
+        include->files.end = tree->included.size();
+        include->resolved = true;
+    }
+
+    debug("resolved %lu includes, loading %lu files", (unsigned long) pending->size(), (unsigned long) paths.size());
+}
+
+/* for when every branch matters, as in fleet mode */
+void load_all_includes(inapt_tree *tree) {
+    std::vector<unsigned> pending;
+
+    do {
+        pending.clear();
+        for (unsigned i = 0; i < tree->includes.size(); i++)
+            if (!tree->includes[i].resolved)
+                pending.push_back(i);
+        if (!pending.empty())
+            load_includes(tree, &pending);
+    } while (!pending.empty());
 }
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/acquire.h>
+#include <apt-pkg/acquire-item.h>
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/pkgrecords.h>
+#include <apt-pkg/sourcelist.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Archives of directive targets that marked cleanly are fetched by a
+ * child process while the rest of the transaction is resolved;
+ * run_install() then only fetches what is still missing. The child works
+ * on its own copy of the cache, the configuration and the records, and
+ * holds the archive lock until it is done. It reports the archives it
+ * downloaded on a pipe, one "index path" line each.
+ */
+struct inapt_prefetch {
+    pid_t pid;
+    int fd;
+    std::vector<pkgCache::VerIterator> versions;
+};
+
+static void run_prefetch(inapt_prefetch *prefetch, pkgCacheFile &cache, FILE *out) {
+    FileFd lock;
+    pkgSourceList sources;
+    pkgRecords records (cache);
+    std::deque<std::string> filenames;      /* outlive the fetcher, whose items point to them */
+    pkgAcquire fetcher;
+    std::vector<pkgAcquire::Item *> items;
+
+    lock.Fd(GetLock(_config->FindDir("Dir::Cache::Archives") + "lock"));
+    if (_error->PendingError() || !sources.ReadMainList() || !fetcher.Setup(NULL))
+        return;
+
+    for (std::vector<pkgCache::VerIterator>::iterator i = prefetch->versions.begin(); i != prefetch->versions.end(); i++) {
+        filenames.push_back(std::string());
+        items.push_back(new pkgAcqArchive(&fetcher, &sources, &records, *i, filenames.back()));
+    }
+
+    /* a missing archive is not an error yet; run_install() will say so */
+    _error->Discard();
+    fetcher.Run();
+
+    for (unsigned i = 0; i < items.size(); i++)
+        if (items[i]->Status == pkgAcquire::Item::StatDone && !items[i]->Local)
+            fprintf(out, "%u %s\n", i, items[i]->DestFile.c_str());
+}
+
+inapt_prefetch *start_prefetch(std::vector<inapt_package *> *final_actions, pkgCacheFile &cache) {
+    if (!_config->FindB("Inapt::Prefetch", true) || _config->FindB("Inapt::Simulate", false))
+        return NULL;
+
+    inapt_prefetch *prefetch = new inapt_prefetch;
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        pkgCache::PkgIterator k = (*i)->pkg;
+        if (k.end() || (*i)->action != inapt_action::INSTALL || !cache[k].Install() || cache[k].InstBroken())
+            continue;
+        prefetch->versions.push_back(cache[k].InstVerIter(cache));
+    }
+
+    int fds[2];
+    if (prefetch->versions.empty() || pipe(fds)) {
+        delete prefetch;
+        return NULL;
+    }
+
+    fflush(NULL);
+    prefetch->pid = fork();
+    if (prefetch->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        delete prefetch;
+        return NULL;
+    }
+
+    if (!prefetch->pid) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        if (out) {
+            run_prefetch(prefetch, cache, out);
+            fclose(out);
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    prefetch->fd = fds[0];
+    debug("prefetching %lu archives", (unsigned long) prefetch->versions.size());
+    return prefetch;
+}
+
+/*
+ * Archives fetched here for packages the final transaction dropped are
+ * deleted, the rest recorded in use. When the run failed (ready is false)
+ * the child is stopped instead and everything it fetched, complete or
+ * not, is deleted.
+ */
+void finish_prefetch(inapt_prefetch *prefetch, pkgCacheFile &cache, inapt_archive_use *use, bool ready) {
+    if (!prefetch)
+        return;
+
+    if (!ready && kill(prefetch->pid, SIGTERM))
+        warnpe("kill: %d", (int) prefetch->pid);
+
+    /* read to the end before waiting, so a long report cannot fill the pipe and stall the child */
+    FILE *in = fdopen(prefetch->fd, "r");
+    char line[PATH_MAX + 32];
+    unsigned index;
+    int path;
+
+    while (in && fgets(line, sizeof(line), in)) {
+        /* a line the stopped child did not finish names no archive */
+        size_t len = strcspn(line, "\n");
+        if (!line[len])
+            continue;
+        line[len] = '\0';
+        if (sscanf(line, "%u %n", &index, &path) < 1 || index >= prefetch->versions.size())
+            continue;
+
+        pkgCache::VerIterator version = prefetch->versions[index];
+        pkgCache::PkgIterator k = version.ParentPkg();
+        if (!ready || !cache[k].Install() || cache[k].InstVerIter(cache) != version) {
+            debug("discarding prefetched %s", line + path);
+            unlink(line + path);
+        } else {
+            use->prefetched.insert(line + path);
+        }
+    }
+    if (in)
+        fclose(in);
+    else
+        close(prefetch->fd);
+
+    while (waitpid(prefetch->pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+
+    /* a download cut short stays in partial/, where the child, holding the lock, was the only writer */
+    if (!ready) {
+        std::string partial = _config->FindDir("Dir::Cache::Archives") + "partial/";
+        for (std::vector<pkgCache::VerIterator>::iterator i = prefetch->versions.begin(); i != prefetch->versions.end(); i++)
+            if (unlink((partial + archive_name(*i)).c_str()) == 0)
+                debug("discarding partial %s", archive_name(*i).c_str());
+    }
+
+    delete prefetch;
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+#include "inapt.h"
+#include "util.h"
+
+/* active holds the root blocks of the files being walked, to catch include loops */
+static void collect_rules(inapt_tree *tree, unsigned block, std::vector<inapt_predicate *> *guards,
+                          std::vector<inapt_predicate *> *unless, std::vector<unsigned> *active,
+                          inapt_profile_graph *graph) {
+    if (block == NO_BLOCK)
+        return;
+
+    inapt_range profiles = tree->blocks[block].profiles;
+    for (unsigned i = profiles.begin; i < profiles.end; i++) {
+        inapt_profile_rule rule;
+        rule.guards = *guards;
+        rule.guards.push_back(&tree->profiles[i].predicates);
+        rule.unless = *unless;
+        rule.profiles = &tree->profiles[i];
+        rule.stratum = 0;
+        graph->rules.push_back(rule);
+    }
+
+    inapt_range children = tree->blocks[block].children;
+    for (unsigned i = children.begin; i < children.end; i++) {
+        inapt_conditional *cond = &tree->conditionals[i];
+
+        guards->push_back(&cond->predicates);
+        collect_rules(tree, cond->then_block, guards, unless, active, graph);
+        guards->pop_back();
+
+        unless->push_back(&cond->predicates);
+        collect_rules(tree, cond->else_block, guards, unless, active, graph);
+        unless->pop_back();
+    }
+
+    inapt_range includes = tree->blocks[block].includes;
+    for (unsigned i = includes.begin; i < includes.end; i++) {
+        inapt_include *include = &tree->includes[i];
+
+        guards->push_back(&include->predicates);
+        for (unsigned j = include->files.begin; j < include->files.end; j++) {
+            unsigned root = tree->included[j];
+            if (std::find(active->begin(), active->end(), root) != active->end()) {
+                std::string path (tree->strings.str(include->path));
+                fatal("%s: %d: Include loop through %s", tree->c_str(include->filename), include->linenum, path.c_str());
+            }
+
+            active->push_back(root);
+            collect_rules(tree, root, guards, unless, active, graph);
+            active->pop_back();
+        }
+        guards->pop_back();
+    }
+}
+
+static void add_watchers(inapt_tree *tree, inapt_profile_graph *graph, unsigned rule, inapt_predicate *predicate) {
+    inapt_range terms = predicate_terms(tree, predicate);
+
+    for (unsigned i = terms.begin; i < terms.end; i++) {
+        std::vector<unsigned> &watchers = graph->watchers[tree->terms[i] >> 1];
+        if (watchers.empty() || watchers.back() != rule)
+            watchers.push_back(rule);
+    }
+}
+
+/* a rule enabling a profile in its own component through a negated term can never settle */
+static void check_negation(inapt_tree *tree, inapt_profile_graph *graph, unsigned rule, inapt_predicate *predicate,
+                           unsigned negated, std::vector<unsigned> *component) {
+    unsigned num_profiles = graph->watchers.size();
+    inapt_range terms = predicate_terms(tree, predicate);
+
+    for (unsigned i = terms.begin; i < terms.end; i++) {
+        unsigned term = tree->terms[i];
+        if ((term & 1) == negated && (*component)[term >> 1] == (*component)[num_profiles + rule]) {
+            inapt_profiles *profiles = graph->rules[rule].profiles;
+            std::string name (tree->strings.profile_name(term >> 1));
+            fatal("%s: %d: Profile %s is enabled by a directive depending on its absence",
+                    tree->c_str(profiles->filename), profiles->linenum, name.c_str());
+        }
+    }
+}
+
+/* successors of a node, as a range of either watchers or enables */
+static void successors(inapt_tree *tree, inapt_profile_graph *graph, unsigned node,
+                       const unsigned **begin, const unsigned **end) {
+    unsigned num_profiles = graph->watchers.size();
+
+    if (node < num_profiles) {
+        *begin = graph->watchers[node].data();
+        *end = *begin + graph->watchers[node].size();
+    } else {
+        inapt_range profiles = graph->rules[node - num_profiles].profiles->profiles;
+        *begin = tree->enables.data() + profiles.begin;
+        *end = tree->enables.data() + profiles.end;
+    }
+}
+
+/*
+ * Nodes are profiles followed by rules, with edges from each profile to the
+ * rules mentioning it and from each rule to the profiles it enables. The
+ * strongly connected components, found with Tarjan's algorithm, become the
+ * strata; within one component every dependency must be positive.
+ */
+static void build_strata(inapt_tree *tree, inapt_profile_graph *graph) {
+    const unsigned unvisited = ~0U;
+    unsigned num_profiles = graph->watchers.size();
+    unsigned num_nodes = num_profiles + graph->rules.size();
+    unsigned next_index = 0, num_components = 0;
+
+    std::vector<unsigned> index (num_nodes, unvisited), lowlink (num_nodes), component (num_nodes);
+    std::vector<bool> on_stack (num_nodes);
+    std::vector<unsigned> stack;
+    std::vector<std::pair<unsigned, unsigned> > calls;
+
+    for (unsigned root = 0; root < num_nodes; root++) {
+        if (index[root] != unvisited)
+            continue;
+
+        index[root] = lowlink[root] = next_index++;
+        stack.push_back(root);
+        on_stack[root] = true;
+        calls.push_back(std::make_pair(root, 0U));
+
+        while (!calls.empty()) {
+            unsigned node = calls.back().first;
+            const unsigned *begin, *end;
+            successors(tree, graph, node, &begin, &end);
+
+            if (calls.back().second < (unsigned) (end - begin)) {
+                unsigned succ = begin[calls.back().second++];
+                if (node < num_profiles)
+                    succ += num_profiles;
+
+                if (index[succ] == unvisited) {
+                    index[succ] = lowlink[succ] = next_index++;
+                    stack.push_back(succ);
+                    on_stack[succ] = true;
+                    calls.push_back(std::make_pair(succ, 0U));
+                } else if (on_stack[succ] && index[succ] < lowlink[node]) {
+                    lowlink[node] = index[succ];
+                }
+                continue;
+            }
+
+            calls.pop_back();
+            if (!calls.empty() && lowlink[node] < lowlink[calls.back().first])
+                lowlink[calls.back().first] = lowlink[node];
+
+            if (lowlink[node] == index[node]) {
+                unsigned member;
+                do {
+                    member = stack.back();
+                    stack.pop_back();
+                    on_stack[member] = false;
+                    component[member] = num_components;
+                } while (member != node);
+                num_components++;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < graph->rules.size(); i++) {
+        inapt_profile_rule *rule = &graph->rules[i];
+        for (std::vector<inapt_predicate *>::iterator j = rule->guards.begin(); j != rule->guards.end(); j++)
+            check_negation(tree, graph, i, *j, 1, &component);
+        for (std::vector<inapt_predicate *>::iterator j = rule->unless.begin(); j != rule->unless.end(); j++)
+            check_negation(tree, graph, i, *j, 0, &component);
+    }
+
+    /* Tarjan finds components dependents first, so number the strata backwards */
+    std::vector<unsigned> stratum (num_components, unvisited);
+    for (unsigned i = 0; i < graph->rules.size(); i++)
+        stratum[component[num_profiles + i]] = 0;
+
+    unsigned num_strata = 0;
+    for (unsigned c = num_components; c-- > 0; )
+        if (stratum[c] != unvisited)
+            stratum[c] = num_strata++;
+    graph->strata.resize(num_strata);
+
+    for (unsigned i = 0; i < graph->rules.size(); i++) {
+        graph->rules[i].stratum = stratum[component[num_profiles + i]];
+        graph->strata[graph->rules[i].stratum].push_back(i);
+    }
+}
+
+void build_profile_graph(inapt_tree *tree, inapt_profile_graph *graph) {
+    std::vector<inapt_predicate *> guards, unless;
+    std::vector<unsigned> active;
+
+    for (std::vector<unsigned>::iterator i = tree->roots.begin(); i != tree->roots.end(); i++) {
+        active.push_back(*i);
+        collect_rules(tree, *i, &guards, &unless, &active, graph);
+        active.pop_back();
+    }
+
+    graph->watchers.resize(tree->strings.profile_count());
+    for (unsigned i = 0; i < graph->rules.size(); i++) {
+        inapt_profile_rule *rule = &graph->rules[i];
+        for (std::vector<inapt_predicate *>::iterator j = rule->guards.begin(); j != rule->guards.end(); j++)
+            add_watchers(tree, graph, i, *j);
+        for (std::vector<inapt_predicate *>::iterator j = rule->unless.begin(); j != rule->unless.end(); j++)
+            add_watchers(tree, graph, i, *j);
+    }
+
+    build_strata(tree, graph);
+
+    /* a rule watching no enabled profile holds exactly when it would with none enabled */
+    inapt_profile_set none;
+    graph->seeds.resize(graph->strata.size());
+    for (unsigned i = 0; i < graph->rules.size(); i++)
+        if (test_rule(tree, &graph->rules[i], &none))
+            graph->seeds[graph->rules[i].stratum].push_back(i);
+}
+
+bool test_rule(inapt_tree *tree, inapt_profile_rule *rule, inapt_profile_set *profiles) {
+    for (std::vector<inapt_predicate *>::iterator i = rule->guards.begin(); i != rule->guards.end(); i++)
+        if (!test_profiles(tree, *i, profiles))
+            return false;
+
+    for (std::vector<inapt_predicate *>::iterator i = rule->unless.begin(); i != rule->unless.end(); i++)
+        if (test_profiles(tree, *i, profiles))
+            return false;
+
+    return true;
+}
+
+/*
+ * Settle each stratum in turn. Only the rules that hold with no profiles
+ * and the watchers of profiles already on are tested up front; any other
+ * rule is tested once a profile it watches turns on, since until then it
+ * cannot hold.
+ */
+void eval_profiles(inapt_tree *tree, inapt_profile_graph *graph, inapt_profile_set *profiles) {
+    std::vector<bool> fired (graph->rules.size());
+    std::vector<std::vector<unsigned> > woken (graph->strata.size());
+    std::vector<unsigned> worklist;
+
+    for (unsigned profile = 0; profile < graph->watchers.size(); profile++) {
+        if (!profiles->test(profile))
+            continue;
+        std::vector<unsigned> &watchers = graph->watchers[profile];
+        for (std::vector<unsigned>::iterator j = watchers.begin(); j != watchers.end(); j++)
+            woken[graph->rules[*j].stratum].push_back(*j);
+    }
+
+    for (unsigned s = 0; s < graph->strata.size(); s++) {
+        worklist.assign(woken[s].rbegin(), woken[s].rend());
+        worklist.insert(worklist.end(), graph->seeds[s].rbegin(), graph->seeds[s].rend());
+
+        while (!worklist.empty()) {
+            unsigned r = worklist.back();
+            worklist.pop_back();
+
+            if (fired[r] || !test_rule(tree, &graph->rules[r], profiles))
+                continue;
+            fired[r] = true;
+
+            inapt_range enabled = graph->rules[r].profiles->profiles;
+            for (unsigned i = enabled.begin; i < enabled.end; i++) {
+                unsigned profile = tree->enables[i];
+                if (profiles->test(profile))
+                    continue;
+                profiles->set(profile);
+
+                std::vector<unsigned> &watchers = graph->watchers[profile];
+                for (std::vector<unsigned>::iterator j = watchers.begin(); j != watchers.end(); j++) {
+                    unsigned stratum = graph->rules[*j].stratum;
+                    if (fired[*j] || stratum < s)
+                        continue;
+                    if (stratum == s)
+                        worklist.push_back(*j);
+                    else
+                        woken[stratum].push_back(*j);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/cachefile.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * A fingerprint of everything a run depends on: the evaluated actions,
+ * the dpkg status file and the APT lists. If it matches the one recorded
+ * after the last successful run, that run's result still stands.
+ */
+
+static std::string state_path(const char *name) {
+    return _config->FindDir("Inapt::State::Directory", "/var/lib/inapt/") + name;
+}
+
+static uint64_t hash_stat(uint64_t hash, struct stat *st) {
+    uint64_t fields[] = {
+        (uint64_t) st->st_dev, (uint64_t) st->st_ino, (uint64_t) st->st_size,
+        (uint64_t) st->st_mtim.tv_sec, (uint64_t) st->st_mtim.tv_nsec,
+    };
+
+    return fnv1a(hash, fields, sizeof(fields));
+}
+
+static uint64_t hash_actions(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    uint64_t hash = FNV_OFFSET;
+    bool flags[] = { _config->FindB("Inapt::Purge", false), _config->FindB("Inapt::Strict", false),
+                     _config->FindB("Inapt::Upgrade", false) };
+
+    hash = fnv1a(hash, flags, sizeof(flags));
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        char action = (*i)->action == inapt_action::INSTALL ? '+' : '-';
+        hash = fnv1a(hash, &action, 1);
+        for (unsigned j = (*i)->alternates.begin; j < (*i)->alternates.end; j++) {
+            std::string_view name = tree->strings.str(tree->names[j]);
+            hash = fnv1a(hash, name.data(), name.size());
+            hash = fnv1a(hash, "/", 1);
+        }
+    }
+
+    return hash;
+}
+
+static uint64_t hash_status() {
+    std::string status = _config->FindFile("Dir::State::status");
+    struct stat st;
+
+    if (stat(status.c_str(), &st))
+        return 0;
+
+    return hash_stat(FNV_OFFSET, &st);
+}
+
+/* apt update replaces the lists by renaming, so their identities are enough */
+static uint64_t hash_lists() {
+    std::string dir = _config->FindDir("Dir::State::lists");
+    std::vector<std::string> names;
+    uint64_t hash = FNV_OFFSET;
+    struct dirent *de;
+    struct stat st;
+
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return 0;
+    while ((de = readdir(d)))
+        if (de->d_name[0] != '.' && strcmp(de->d_name, "lock") && strcmp(de->d_name, "partial"))
+            names.push_back(de->d_name);
+    closedir(d);
+
+    std::sort(names.begin(), names.end());
+    for (std::vector<std::string>::iterator i = names.begin(); i != names.end(); i++) {
+        if (stat((dir + *i).c_str(), &st))
+            continue;
+        hash = fnv1a(hash, i->c_str(), i->size() + 1);
+        hash = hash_stat(hash, &st);
+    }
+
+    return hash;
+}
+
+std::string state_fingerprint(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%016llx %016llx %016llx",
+             (unsigned long long) hash_actions(tree, final_actions),
+             (unsigned long long) hash_status(), (unsigned long long) hash_lists());
+    return buf;
+}
+
+/*
+ * The plan of one transaction: every package it installs or removes, with
+ * the version it installs. Matching plans fetch the same archives.
+ */
+std::string plan_fingerprint(pkgCacheFile &cache) {
+    uint64_t hash = FNV_OFFSET;
+    char buf[32];
+
+    for (pkgCache::PkgIterator i = cache->PkgBegin(); !i.end(); i++) {
+        char action;
+
+        if (cache[i].Install())
+            action = '+';
+        else if (cache[i].Delete())
+            action = cache[i].Purge() ? '!' : '-';
+        else
+            continue;
+
+        std::string name = i.FullName();
+        hash = fnv1a(hash, &action, 1);
+        hash = fnv1a(hash, name.c_str(), name.size() + 1);
+        if (action == '+') {
+            const char *version = cache[i].InstVerIter(cache).VerStr();
+            hash = fnv1a(hash, version, strlen(version) + 1);
+        }
+    }
+
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) hash);
+    return buf;
+}
+
+
+/* the first line of a file in the state directory, or nothing */
+std::string read_state(const char *name) {
+    std::ifstream in (state_path(name).c_str());
+    std::string line;
+
+    std::getline(in, line);
+    return line;
+}
+
+void write_state(const char *name, const std::string &value) {
+    std::string dir = _config->FindDir("Inapt::State::Directory", "/var/lib/inapt/");
+    std::string path = state_path(name);
+    std::string tmp = path + ".new";
+
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        warnpe("mkdir: %s", dir.c_str());
+        return;
+    }
+
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        warnpe("open: %s", tmp.c_str());
+        return;
+    }
+
+    fprintf(f, "%s\n", value.c_str());
+    if (fclose(f) || rename(tmp.c_str(), path.c_str())) {
+        warnpe("write: %s", path.c_str());
+        unlink(tmp.c_str());
+    }
+}
+
+void clear_state(const char *name) {
+    std::string path = state_path(name);
+
+    if (unlink(path.c_str()) && errno != ENOENT)
+        warnpe("unlink: %s", path.c_str());
+}
+
+/*
+ * The journal lists the directives the last completed run applied, one
+ * per line, under a header holding the dpkg status and the lists it left
+ * behind and the flags it ran with. While all of those still hold, every
+ * directive found there, as often as it is found there, is known to be in
+ * effect and to sit well with the others, since that run marked them all
+ * together. A spec that only lost directives needs no run at all.
+ */
+
+static std::string action_key(inapt_tree *tree, inapt_package *package) {
+    std::string key (1, package->action == inapt_action::INSTALL ? '+' : '-');
+
+    for (unsigned j = package->alternates.begin; j < package->alternates.end; j++) {
+        if (j != package->alternates.begin)
+            key += '/';
+        key.append(tree->strings.str(tree->names[j]));
+    }
+
+    return key;
+}
+
+static std::string journal_header() {
+    char buf[96];
+
+    snprintf(buf, sizeof(buf), "journal %016llx %016llx %d%d", (unsigned long long) hash_status(),
+             (unsigned long long) hash_lists(), _config->FindB("Inapt::Purge", false),
+             _config->FindB("Inapt::Strict", false));
+    return buf;
+}
+
+/*
+ * Directives that found no package were not applied, and stay out so the
+ * next run retries them. Their packages are only valid while the cache
+ * they were resolved on is open, so this is called before it is closed.
+ */
+void write_journal(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    std::string journal = journal_header();
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        if ((*i)->pkg.end())
+            continue;
+        journal += '\n';
+        journal += action_key(tree, *i);
+    }
+
+    write_state("journal", journal);
+}
+
+/*
+ * Whether the journal shows every directive applied, so that a full run
+ * would mark nothing new. Anything else, including an upgrade, which
+ * concerns every package, means a full run.
+ */
+bool journal_covers(inapt_tree *tree, std::vector<inapt_package *> *final_actions) {
+    std::ifstream in (state_path("journal").c_str());
+    std::unordered_map<std::string, unsigned> applied;
+    std::string line;
+
+    if (_config->FindB("Inapt::Upgrade", false))
+        return false;
+    if (!std::getline(in, line) || line != journal_header())
+        return false;
+
+    while (std::getline(in, line))
+        if (!line.empty())
+            applied[line]++;
+
+    for (std::vector<inapt_package *>::iterator i = final_actions->begin(); i != final_actions->end(); i++) {
+        std::unordered_map<std::string, unsigned>::iterator entry = applied.find(action_key(tree, *i));
+        if (entry == applied.end() || !entry->second--)
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Wall time, CPU time and peak RSS per phase of a run, plus a few
+ * counters, written when the process exits to the file named by
+ * Inapt::Telemetry::File, as JSON or, if the name ends in .prom, in the
+ * Prometheus text format for node_exporter's textfile collector. Without
+ * that setting every call here returns at once.
+ */
+
+struct telemetry_phase {
+    const char *name;
+    double wall, cpu;
+    long max_rss;
+    double wall_start, cpu_start;
+};
+
+struct telemetry_counter {
+    const char *name;
+    unsigned long long value;
+};
+
+static bool enabled;
+static std::string path;
+static std::vector<telemetry_phase> phases;
+static std::vector<unsigned> open_phases;
+static std::vector<telemetry_counter> counters;
+
+static double wall_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* covers every thread, so phases that fan out count all of their work */
+static double cpu_now(long *max_rss) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    if (max_rss)
+        *max_rss = ru.ru_maxrss * 1024L;
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool prometheus() {
+    return path.size() > 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+}
+
+static void write_json(FILE *f) {
+    fprintf(f, "{\n  \"phases\": [");
+    for (unsigned i = 0; i < phases.size(); i++)
+        fprintf(f, "%s\n    { \"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"max_rss_bytes\": %ld }",
+                i ? "," : "", phases[i].name, phases[i].wall, phases[i].cpu, phases[i].max_rss);
+    fprintf(f, "\n  ],\n  \"counters\": {");
+    for (unsigned i = 0; i < counters.size(); i++)
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", counters[i].name, counters[i].value);
+    fprintf(f, "\n  }\n}\n");
+}
+
+static void write_prometheus(FILE *f) {
+    static const char *metrics[][2] = {
+        { "inapt_phase_wall_seconds", "Wall time spent in each phase of the last run." },
+        { "inapt_phase_cpu_seconds", "CPU time spent in each phase of the last run." },
+        { "inapt_phase_max_rss_bytes", "Peak resident set size at the end of each phase of the last run." },
+    };
+
+    for (unsigned m = 0; m < 3; m++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n", metrics[m][0], metrics[m][1], metrics[m][0]);
+        for (std::vector<telemetry_phase>::iterator i = phases.begin(); i != phases.end(); i++) {
+            if (m == 2)
+                fprintf(f, "%s{phase=\"%s\"} %ld\n", metrics[m][0], i->name, i->max_rss);
+            else
+                fprintf(f, "%s{phase=\"%s\"} %.6f\n", metrics[m][0], i->name, m ? i->cpu : i->wall);
+        }
+    }
+
+    for (std::vector<telemetry_counter>::iterator i = counters.begin(); i != counters.end(); i++)
+        fprintf(f, "# TYPE inapt_%s gauge\ninapt_%s %llu\n", i->name, i->name, i->value);
+}
+
+/* written through a temporary file, since the collector may read it at any time */
+static void telemetry_write() {
+    while (!open_phases.empty())
+        telemetry_end();
+
+    std::string tmp = path + ".new";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        warnpe("open: %s", tmp.c_str());
+        return;
+    }
+
+    if (prometheus())
+        write_prometheus(f);
+    else
+        write_json(f);
+
+    if (fclose(f) || rename(tmp.c_str(), path.c_str())) {
+        warnpe("write: %s", path.c_str());
+        unlink(tmp.c_str());
+    }
+}
+
+void telemetry_init() {
+    path = _config->Find("Inapt::Telemetry::File");
+    enabled = !path.empty();
+    if (enabled)
+        atexit(telemetry_write);
+}
+
+void telemetry_begin(const char *name) {
+    if (!enabled)
+        return;
+
+    /* a phase entered again, like a round of include loading, adds to its totals */
+    unsigned id;
+    for (id = 0; id < phases.size(); id++)
+        if (!strcmp(phases[id].name, name))
+            break;
+    if (id == phases.size()) {
+        telemetry_phase phase = { name, 0, 0, 0, 0, 0 };
+        phases.push_back(phase);
+    }
+
+    phases[id].wall_start = wall_now();
+    phases[id].cpu_start = cpu_now(NULL);
+    open_phases.push_back(id);
+}
+
+void telemetry_end() {
+    if (!enabled || open_phases.empty())
+        return;
+
+    telemetry_phase *phase = &phases[open_phases.back()];
+    open_phases.pop_back();
+    phase->wall += wall_now() - phase->wall_start;
+    phase->cpu += cpu_now(&phase->max_rss) - phase->cpu_start;
+}
+
+void telemetry_count(const char *name, unsigned long long value) {
+    if (!enabled)
+        return;
+
+    for (std::vector<telemetry_counter>::iterator i = counters.begin(); i != counters.end(); i++) {
+        if (!strcmp(i->name, name)) {
+            i->value += value;
+            return;
+        }
+    }
+
+    telemetry_counter counter = { name, value };
+    counters.push_back(counter);
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/init.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Checks --check against a small APT root built on the spot: a Packages
+ * list offering most packages, as apt update would leave it, and a dpkg
+ * status file with some of them installed. The spec names alternates, so
+ * the check has to act on the same alternate a run would: the first real
+ * package, never a virtual package for a removal, and nothing at all for
+ * a name neither file knows.
+ */
+
+char *prog = NULL;
+
+static const char *repository =
+    "Package: foo\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: bar\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: baz\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: qux\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: absent\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: prov\nVersion: 1.0\nArchitecture: all\nProvides: virt\n\n";
+
+static const char *status =
+    "Package: foo\nStatus: install ok installed\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: baz\nStatus: install ok installed\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: qux\nStatus: install ok installed\nVersion: 1.0\nArchitecture: all\n\n"
+    "Package: prov\nStatus: install ok installed\nVersion: 1.0\nArchitecture: all\nProvides: virt\n\n"
+    "Package: old\nStatus: deinstall ok config-files\nVersion: 0.9\nArchitecture: all\n\n";
+
+/* one directive per line, so each expected line names its directive */
+static const char *spec =
+    "install foo/bar;\n"
+    "install absent/foo;\n"
+    "install virt;\n"
+    "remove absent/baz;\n"
+    "remove virt/qux;\n"
+    "remove old;\n";
+
+static const char *expected =
+    "spec:2: missing absent\n"
+    "spec:5: lingering qux\n";
+
+static void write_file(const std::string &path, const char *data) {
+    FILE *f = fopen(path.c_str(), "w");
+
+    if (!f || fputs(data, f) == EOF || fclose(f))
+        fatalpe("write: %s", path.c_str());
+}
+
+static void make_root(const std::string &root) {
+    const char *subdirs[] = {
+        "/var", "/var/lib", "/var/lib/dpkg", "/var/lib/apt", "/var/lib/apt/lists",
+    };
+
+    for (unsigned i = 0; i < sizeof(subdirs) / sizeof(*subdirs); i++)
+        if (mkdir((root + subdirs[i]).c_str(), 0755) && errno != EEXIST)
+            fatalpe("mkdir: %s%s", root.c_str(), subdirs[i]);
+
+    write_file(root + "/var/lib/apt/lists/local_._Packages", repository);
+    write_file(root + "/var/lib/dpkg/status", status);
+    write_file(root + "/spec", spec);
+}
+
+static void configure(const std::string &root) {
+    pkgInitConfig(*_config);
+    _config->Set("Dir::State", root + "/var/lib/apt/");
+    _config->Set("Dir::State::status", root + "/var/lib/dpkg/status");
+    _config->Set("Inapt::Cache", false);
+    _config->Set("Inapt::Purge", true);
+}
+
+int main(int argc, char *argv[]) {
+    char dir[PATH_MAX];
+    inapt_tree tree;
+    std::vector<inapt_package *> final_actions;
+    std::vector<const char *> files, profiles;
+
+    prog = xstrdup(basename(argv[0]));
+    /* under the tree, as with bench/fixture, so make clean removes it */
+    if (mkdir("tests/fixture", 0755) && errno != EEXIST)
+        fatalpe("mkdir: tests/fixture");
+    if (!realpath("tests/fixture", dir))
+        fatalpe("realpath: tests/fixture");
+    std::string root = dir;
+
+    make_root(root);
+    configure(root);
+
+    /* relative, so the file names in the report do not depend on the directory */
+    if (chdir(dir))
+        fatalpe("chdir: %s", dir);
+    files.push_back("spec");
+    parser(&files, &tree);
+    eval_spec(&tree, &profiles, &final_actions);
+
+    char *output = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&output, &size);
+    if (!out)
+        fatalpe("open_memstream");
+    int status = check_drift(&tree, &final_actions, out);
+    fclose(out);
+    _error->Discard();
+
+    if (status != 3 || strcmp(output, expected)) {
+        fprintf(stderr, "%s: check exited %d with\n%sinstead of 3 with\n%s", prog, status, output, expected);
+        return 1;
+    }
+
+    printf("%s: ok\n", prog);
+    free(output);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include <apt-pkg/cachefile.h>
+#include <apt-pkg/configuration.h>
+#include <apt-pkg/error.h>
+#include <apt-pkg/init.h>
+#include <apt-pkg/pkgsystem.h>
+#include <apt-pkg/strutl.h>
+
+#include "inapt.h"
+#include "util.h"
+
+/*
+ * Prefetches from a repository in a local directory. It is reached with
+ * copy: rather than file:, since apt installs file: archives from where
+ * they are and so would leave nothing to prefetch. A run that goes ahead
+ * keeps the archive and reports it as fetched, not cached; a run that
+ * fails leaves neither the archive nor a partial download behind.
+ */
+
+char *prog = NULL;
+
+static const char *archive = "inapt prefetch test\n";
+
+static const char *packages =
+    "Package: foo\nVersion: 1.0\nArchitecture: all\nFilename: foo_1.0_all.deb\nSize: 20\n"
+    "SHA256: 23fa49dd4f88b0a0daf0a193e1139340e6af2b3e01ba8c2b41042e71257e623b\n\n";
+
+static void write_file(const std::string &path, const char *data) {
+    FILE *f = fopen(path.c_str(), "w");
+
+    if (!f || fputs(data, f) == EOF || fclose(f))
+        fatalpe("write: %s", path.c_str());
+}
+
+static bool exists(const std::string &path) {
+    struct stat st;
+    return !stat(path.c_str(), &st);
+}
+
+static void make_root(const std::string &root) {
+    const char *subdirs[] = {
+        "/repo", "/etc", "/etc/apt", "/etc/apt/sources.list.d", "/var", "/var/lib", "/var/lib/dpkg",
+        "/var/lib/apt", "/var/lib/apt/lists", "/var/cache", "/var/cache/apt", "/var/cache/apt/archives",
+        "/var/cache/apt/archives/partial",
+    };
+
+    for (unsigned i = 0; i < sizeof(subdirs) / sizeof(*subdirs); i++)
+        if (mkdir((root + subdirs[i]).c_str(), 0755) && errno != EEXIST)
+            fatalpe("mkdir: %s%s", root.c_str(), subdirs[i]);
+
+    std::string uri = "copy:" + root + "/repo/";
+    write_file(root + "/repo/foo_1.0_all.deb", archive);
+    write_file(root + "/repo/Packages", packages);
+    /* as apt update would leave the list of a flat repository without a Release file */
+    write_file(root + "/var/lib/apt/lists/" + URItoFileName(uri + "./Packages"), packages);
+    write_file(root + "/etc/apt/sources.list", ("deb [trusted=yes] " + uri + " ./\n").c_str());
+    write_file(root + "/var/lib/dpkg/status", "");
+    write_file(root + "/spec", "install foo;\n");
+}
+
+static void configure(const std::string &root) {
+    pkgInitConfig(*_config);
+    _config->Set("Dir::Etc::sourcelist", root + "/etc/apt/sources.list");
+    _config->Set("Dir::Etc::sourceparts", root + "/etc/apt/sources.list.d/");
+    _config->Set("Dir::State", root + "/var/lib/apt/");
+    _config->Set("Dir::State::status", root + "/var/lib/dpkg/status");
+    _config->Set("Dir::Cache", root + "/var/cache/apt/");
+    _config->Set("Dir::Cache::pkgcache", "");
+    _config->Set("Dir::Cache::srcpkgcache", "");
+    _config->Set("Inapt::Cache", false);
+    /* the fixture belongs to whoever runs the test, who the _apt user may not be able to write for */
+    _config->Set("APT::Sandbox::User", "root");
+    pkgInitSystem(*_config, _system);
+}
+
+/* one prefetch of everything the spec installs, finished as a run that went ahead or failed would */
+static void fetch(std::vector<inapt_package *> *final_actions, pkgCacheFile &cache,
+                  inapt_archive_use *use, bool ready) {
+    inapt_prefetch *prefetch = start_prefetch(final_actions, cache);
+    if (!prefetch)
+        fatal("nothing was prefetched");
+    finish_prefetch(prefetch, cache, use, ready);
+}
+
+int main(int argc, char *argv[]) {
+    char dir[PATH_MAX];
+    inapt_tree tree;
+    std::vector<inapt_package *> final_actions;
+    std::vector<const char *> files, profiles;
+    int marked = 0, failed = 0;
+
+    prog = xstrdup(basename(argv[0]));
+    /* under the tree, as with tests/fixture, so make clean removes it */
+    if (mkdir("tests/prefetch-fixture", 0755) && errno != EEXIST)
+        fatalpe("mkdir: tests/prefetch-fixture");
+    if (!realpath("tests/prefetch-fixture", dir))
+        fatalpe("realpath: tests/prefetch-fixture");
+    std::string root = dir;
+
+    make_root(root);
+    configure(root);
+
+    files.push_back(xstrdup((root + "/spec").c_str()));
+    parser(&files, &tree);
+    eval_spec(&tree, &profiles, &final_actions);
+
+    pkgCacheFile cache;
+    if (!cache.Open(NULL, false) || !mark_actions(&tree, &final_actions, cache, &marked)) {
+        _error->DumpErrors();
+        fatal("unable to mark the spec");
+    }
+
+    std::string fetched = _config->FindDir("Dir::Cache::Archives") + "foo_1.0_all.deb";
+    std::string partial = _config->FindDir("Dir::Cache::Archives") + "partial/foo_1.0_all.deb";
+
+    inapt_archive_use kept;
+    fetch(&final_actions, cache, &kept, true);
+    if (!exists(fetched) || !kept.prefetched.count(fetched)) {
+        fprintf(stderr, "%s: a run that went ahead did not keep %s as fetched\n", prog, fetched.c_str());
+        failed++;
+    }
+
+    unlink(fetched.c_str());
+    inapt_archive_use dropped;
+    fetch(&final_actions, cache, &dropped, false);
+    if (exists(fetched) || exists(partial) || !dropped.prefetched.empty()) {
+        fprintf(stderr, "%s: a failed run left its prefetch behind\n", prog);
+        failed++;
+    }
+
+    _error->Discard();
+    if (failed)
+        return 1;
+
+    printf("%s: ok\n", prog);
+    return 0;
+}
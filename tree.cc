@@ -0,0 +1,226 @@
+#include <sys/mman.h>
+#include <algorithm>
+
+#include "inapt.h"
+#include "util.h"
+
+inapt_mapping::~inapt_mapping() {
+    if (mapped)
+        munmap(data, size);
+    else
+        free(data);
+}
+
+unsigned inapt_strings::intern(std::string_view s) {
+    std::unordered_map<std::string_view, unsigned>::iterator i = ids.find(s);
+
+    if (i != ids.end())
+        return i->second;
+
+    unsigned id = strings.size();
+    strings.push_back(s);
+    copied.push_back(false);
+    profile_ids.push_back(NO_PROFILE);
+    ids[s] = id;
+    return id;
+}
+
+unsigned inapt_strings::intern_copy(std::string_view s) {
+    unsigned id = intern(s);
+
+    /* the deque never moves its elements, so views of the copies stay valid */
+    if (!copied[id]) {
+        copies.push_back(std::string(s));
+        std::string_view copy (copies.back());
+
+        ids.erase(strings[id]);
+        strings[id] = copy;
+        ids[copy] = id;
+        copied[id] = true;
+    }
+
+    return id;
+}
+
+unsigned inapt_strings::profile(std::string_view s) {
+    unsigned id = intern(s);
+
+    if (profile_ids[id] == NO_PROFILE) {
+        profile_ids[id] = profile_names.size();
+        profile_names.push_back(id);
+    }
+
+    return profile_ids[id];
+}
+
+/* where the nodes of one part land in the tree it is merged into */
+struct merge_offsets {
+    std::vector<unsigned> strings, profile_ids;
+    unsigned terms, clauses, names, enables, packages, actions, conditionals, profiles, includes, blocks;
+};
+
+static inline inapt_range shift_range(inapt_range range, unsigned offset) {
+    range.begin += offset;
+    range.end += offset;
+    return range;
+}
+
+static inline inapt_predicate shift_predicate(inapt_predicate predicate, merge_offsets *offsets) {
+    predicate.clauses = shift_range(predicate.clauses, offsets->clauses);
+    return predicate;
+}
+
+static void merge_actions(inapt_tree *to, inapt_tree *from, inapt_range range, merge_offsets *offsets) {
+    for (unsigned i = range.begin; i < range.end; i++) {
+        inapt_action action = from->actions[i];
+        action.predicates = shift_predicate(action.predicates, offsets);
+        action.packages = shift_range(action.packages, offsets->packages);
+        to->actions.push_back(action);
+    }
+}
+
+static void merge_conditionals(inapt_tree *to, inapt_tree *from, inapt_range range, merge_offsets *offsets) {
+    for (unsigned i = range.begin; i < range.end; i++) {
+        inapt_conditional cond = from->conditionals[i];
+        cond.predicates = shift_predicate(cond.predicates, offsets);
+        cond.then_block += offsets->blocks;
+        if (cond.else_block != NO_BLOCK)
+            cond.else_block += offsets->blocks;
+        to->conditionals.push_back(cond);
+    }
+}
+
+static void merge_profiles(inapt_tree *to, inapt_tree *from, inapt_range range, merge_offsets *offsets) {
+    for (unsigned i = range.begin; i < range.end; i++) {
+        inapt_profiles profiles = from->profiles[i];
+        profiles.predicates = shift_predicate(profiles.predicates, offsets);
+        profiles.profiles = shift_range(profiles.profiles, offsets->enables);
+        profiles.filename = offsets->strings[profiles.filename];
+        to->profiles.push_back(profiles);
+    }
+}
+
+static void merge_includes(inapt_tree *to, inapt_tree *from, inapt_range range, merge_offsets *offsets) {
+    for (unsigned i = range.begin; i < range.end; i++) {
+        inapt_include include = from->includes[i];
+        include.predicates = shift_predicate(include.predicates, offsets);
+        include.path = offsets->strings[include.path];
+        include.filename = offsets->strings[include.filename];
+        to->includes.push_back(include);
+    }
+}
+
+/*
+ * Appends every node of a part except its root block, remapping string and
+ * profile ids to the tree's own. The root block closes last, so its
+ * children are the tail of each array and are left for merge_tree().
+ */
+static void merge_nodes(inapt_tree *to, inapt_tree *from, merge_offsets *offsets) {
+    inapt_block *root = &from->blocks[from->roots.back()];
+
+    for (std::vector<std::shared_ptr<inapt_mapping> >::iterator i = from->mappings.begin(); i != from->mappings.end(); i++)
+        if (std::find(to->mappings.begin(), to->mappings.end(), *i) == to->mappings.end())
+            to->mappings.push_back(*i);
+
+    for (unsigned i = 0; i < from->strings.strings.size(); i++) {
+        std::string_view s = from->strings.str(i);
+        offsets->strings.push_back(from->strings.copied[i] ? to->strings.intern_copy(s) : to->strings.intern(s));
+    }
+
+    for (unsigned i = 0; i < from->strings.profile_count(); i++)
+        offsets->profile_ids.push_back(to->strings.profile(to->strings.str(offsets->strings[from->strings.profile_names[i]])));
+
+    offsets->terms = to->terms.size();
+    for (std::vector<unsigned>::iterator i = from->terms.begin(); i != from->terms.end(); i++)
+        to->terms.push_back(offsets->profile_ids[*i >> 1] << 1 | (*i & 1));
+
+    offsets->clauses = to->clauses.size();
+    for (std::vector<inapt_range>::iterator i = from->clauses.begin(); i != from->clauses.end(); i++)
+        to->clauses.push_back(shift_range(*i, offsets->terms));
+
+    offsets->names = to->names.size();
+    for (std::vector<unsigned>::iterator i = from->names.begin(); i != from->names.end(); i++)
+        to->names.push_back(offsets->strings[*i]);
+
+    offsets->enables = to->enables.size();
+    for (std::vector<unsigned>::iterator i = from->enables.begin(); i != from->enables.end(); i++)
+        to->enables.push_back(offsets->profile_ids[*i]);
+
+    offsets->packages = to->packages.size();
+    for (std::vector<inapt_package>::iterator i = from->packages.begin(); i != from->packages.end(); i++) {
+        inapt_package package = *i;
+        package.alternates = shift_range(package.alternates, offsets->names);
+        package.predicates = shift_predicate(package.predicates, offsets);
+        package.filename = offsets->strings[package.filename];
+        to->packages.push_back(package);
+    }
+
+    offsets->actions = to->actions.size();
+    offsets->conditionals = to->conditionals.size();
+    offsets->profiles = to->profiles.size();
+    offsets->includes = to->includes.size();
+    offsets->blocks = to->blocks.size();
+
+    inapt_range actions = { 0, root->actions.begin };
+    inapt_range conditionals = { 0, root->children.begin };
+    inapt_range profiles = { 0, root->profiles.begin };
+    inapt_range includes = { 0, root->includes.begin };
+    merge_actions(to, from, actions, offsets);
+    merge_conditionals(to, from, conditionals, offsets);
+    merge_profiles(to, from, profiles, offsets);
+    merge_includes(to, from, includes, offsets);
+
+    for (unsigned i = 0; i < from->roots.back(); i++) {
+        inapt_block block = from->blocks[i];
+        block.actions = shift_range(block.actions, offsets->actions);
+        block.children = shift_range(block.children, offsets->conditionals);
+        block.profiles = shift_range(block.profiles, offsets->profiles);
+        block.includes = shift_range(block.includes, offsets->includes);
+        to->blocks.push_back(block);
+    }
+}
+
+/*
+ * Appends the parts of one input, each parsed into a tree with a single
+ * root, as one root block holding the children of every part's root in
+ * order, and returns that block. The result is the tree the input would
+ * have parsed to whole. Includes are merged unresolved.
+ */
+unsigned merge_tree(inapt_tree *to, std::vector<inapt_tree *> *parts) {
+    std::vector<merge_offsets> offsets (parts->size());
+    inapt_block root;
+
+    for (unsigned i = 0; i < parts->size(); i++)
+        merge_nodes(to, (*parts)[i], &offsets[i]);
+
+    root.actions.begin = to->actions.size();
+    for (unsigned i = 0; i < parts->size(); i++) {
+        inapt_tree *from = (*parts)[i];
+        merge_actions(to, from, from->blocks[from->roots.back()].actions, &offsets[i]);
+    }
+    root.actions.end = to->actions.size();
+
+    root.children.begin = to->conditionals.size();
+    for (unsigned i = 0; i < parts->size(); i++) {
+        inapt_tree *from = (*parts)[i];
+        merge_conditionals(to, from, from->blocks[from->roots.back()].children, &offsets[i]);
+    }
+    root.children.end = to->conditionals.size();
+
+    root.profiles.begin = to->profiles.size();
+    for (unsigned i = 0; i < parts->size(); i++) {
+        inapt_tree *from = (*parts)[i];
+        merge_profiles(to, from, from->blocks[from->roots.back()].profiles, &offsets[i]);
+    }
+    root.profiles.end = to->profiles.size();
+
+    root.includes.begin = to->includes.size();
+    for (unsigned i = 0; i < parts->size(); i++) {
+        inapt_tree *from = (*parts)[i];
+        merge_includes(to, from, from->blocks[from->roots.back()].includes, &offsets[i]);
+    }
+    root.includes.end = to->includes.size();
+
+    to->blocks.push_back(root);
+    return to->blocks.size() - 1;
+}
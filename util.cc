@@ -8,6 +8,9 @@
 #include <errno.h>
 #include <grp.h>
 #include <pwd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "util.h"
 
@@ -113,3 +116,29 @@ void warnpe(const char *msg, ...) {
     errmsgpe(LOG_WARNING, "warning", msg, args);
     va_end(args);
 }
+
+/*
+ * Calls work(i) for every i below count, handing out the next i to
+ * whichever of up to threads threads (the caller's among them) is free,
+ * and returns once all are done. Any order between calls is up to work.
+ */
+void parallel_for(unsigned count, unsigned threads, const std::function<void (unsigned)> &work) {
+    std::atomic<unsigned> next (0);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > count)
+        threads = count;
+
+    auto worker = [&]() {
+        for (unsigned i; (i = next++) < count; )
+            work(i);
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (std::vector<std::thread>::iterator i = pool.begin(); i != pool.end(); i++)
+        i->join();
+}
@@ -8,6 +8,7 @@
 #include <syslog.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <functional>
 
 #ifdef __GNUC__
 #define NORETURN __attribute__((__noreturn__))
@@ -29,6 +30,8 @@ PRINTF_LIKE(1) void debugn(int level, const char *, ...);
 PRINTF_LIKE(0) void errorpe(const char *, ...);
 PRINTF_LIKE(0) void warnpe(const char *, ...);
 
+void parallel_for(unsigned count, unsigned threads, const std::function<void (unsigned)> &work);
+
 static inline void *xmalloc(size_t size) {
     void *alloc = malloc(size);
 